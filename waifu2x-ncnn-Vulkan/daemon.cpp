@@ -0,0 +1,536 @@
+// w2xncnnvk-daemon, owns the gpu and the engines for every plugin instance started with server=name or remote=host:port
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "netipc.h"
+#include "shmipc.h"
+#include "waifu2x.h"
+
+// where the build installs the models next to the plugin
+#ifndef WAIFU2X_MODELS_DIR
+#define WAIFU2X_MODELS_DIR "models"
+#endif
+
+static std::atomic<bool> stop_requested(false);
+
+static void on_signal(int)
+{
+    stop_requested = true;
+}
+
+static void print_usage()
+{
+    fprintf(stderr, "Usage: w2xncnnvk-daemon [options]\n\n");
+    fprintf(stderr, "  -n name       name clients pass as server= (default=w2xncnnvk)\n");
+    fprintf(stderr, "  -g gpu-id     gpu device to use (default=auto)\n");
+    fprintf(stderr, "  -j threads    frames upscaled at once over all clients (default=2)\n");
+    fprintf(stderr, "  -t tile-size  tile size for clients that do not set tile_w and tile_h (default=400)\n");
+    fprintf(stderr, "  -m path       directory holding the models-* directories (default=%s)\n", WAIFU2X_MODELS_DIR);
+    fprintf(stderr, "  -p port       also serve remote= clients over tcp on this port (default=0, disabled)\n");
+    fprintf(stderr, "  -b address    address to listen on with -p, :: for all interfaces (default=127.0.0.1)\n");
+    fprintf(stderr, "  -c count      tcp connections served at once, further ones are closed (default=16)\n");
+    fprintf(stderr, "  -e engines    engines kept loaded, the least recently used idle one is unloaded beyond that (default=4)\n");
+    fprintf(stderr, "  -w seconds    a tcp connection whose client sends or takes nothing for this long is closed (default=60)\n");
+    fprintf(stderr, "  -s megapixels largest frame a tcp client may send or ask for, input or output (default=134)\n");
+}
+
+// largest tile and output size a client may ask for
+static const int max_tile_size = 16384;
+static const int max_target_size = 65536;
+
+// engines by their settings, each network is loaded into vram once however many clients use it
+class EngineRegistry
+{
+public:
+    EngineRegistry(int gpuid, int default_tile, const std::string& models_dir, int threads, int max_engines)
+        : gpuid(gpuid), default_tile(default_tile), models_dir(models_dir), max_engines(max_engines), gpu_slots(threads), clock(0)
+    {
+    }
+
+    // packed planes, at most threads frames run at once over shared memory and tcp clients
+    int process(const Waifu2xEngineConfig& config, const float* in, float* out,
+                const int w, const int h, const int out_w, const int out_h, Waifu2xStats& stats)
+    {
+        if (out_w != (config.target_width ? config.target_width : w * config.scale)
+                || out_h != (config.target_height ? config.target_height : h * config.scale))
+            return -1;
+
+        std::shared_ptr<Waifu2x> engine = get(config);
+        if (!engine)
+            return -1;
+
+        const size_t in_plane = (size_t)w * h;
+        const size_t out_plane = (size_t)out_w * out_h;
+
+        gpu_slots.acquire();
+        int ret = engine->process(in, in + in_plane, in + in_plane * 2,
+                                  out, out + out_plane, out + out_plane * 2,
+                                  w, h, w, out_w, &stats);
+        gpu_slots.release();
+
+        return ret;
+    }
+
+    // 0 if the settings are invalid or the model does not load, the engine stays loaded while it is held
+    std::shared_ptr<Waifu2x> get(const Waifu2xEngineConfig& _config)
+    {
+        Waifu2xEngineConfig config = _config;
+        if (!normalize(config))
+            return std::shared_ptr<Waifu2x>();
+
+        const std::string key((const char*)&config, sizeof(config));
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        std::map<std::string, Entry>::iterator it = engines.find(key);
+        if (it != engines.end())
+        {
+            it->second.last_used = ++clock;
+            return it->second.engine;
+        }
+
+        evict_idle();
+
+        std::shared_ptr<Waifu2x> engine = create(config);
+        if (!engine)
+            return std::shared_ptr<Waifu2x>();
+
+        fprintf(stderr, "loaded model=%d noise=%d scale=%d tta=%d fp32=%d deterministic=%d, %d engines\n",
+                config.model, config.noise, config.scale, config.tta, config.fp32, config.deterministic, (int)engines.size() + 1);
+
+        Entry& entry = engines[key];
+        entry.engine = engine;
+        entry.last_used = ++clock;
+        return engine;
+    }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<Waifu2x> engine;
+        uint64_t last_used;
+    };
+
+    // rejects what no plugin sends and folds settings that do not change the output,
+    // so that a client cannot load a new engine per value of an unused field
+    bool normalize(Waifu2xEngineConfig& config) const
+    {
+        if (config.model < 0 || config.model > 3 || config.noise < -1 || config.noise > 3)
+            return false;
+
+        if (config.scale != 1 && config.scale != 2 && config.scale != 4 && config.scale != 8)
+            return false;
+
+        if (config.model != 2 && config.scale == 1)
+            return false;
+
+        if (config.tta != 0 && config.tta != 2 && config.tta != 4 && config.tta != 8)
+            return false;
+
+        if (config.tile_w < 0 || config.tile_h < 0 || config.tile_w > max_tile_size || config.tile_h > max_tile_size)
+            return false;
+
+        if ((config.tile_w && config.tile_w < 32) || (config.tile_h && config.tile_h < 32))
+            return false;
+
+        if (config.target_width < 0 || config.target_height < 0 || config.target_width > max_target_size || config.target_height > max_target_size)
+            return false;
+
+        if ((config.target_width == 0) != (config.target_height == 0))
+            return false;
+
+        // the plugin sends whole frame tiles and fp32 in deterministic mode, a default tile would split the frame
+        if (config.deterministic && (!config.tile_w || !config.tile_h || !config.fp32))
+            return false;
+
+        const float thresholds[] = { config.tta_threshold, config.flat_threshold, config.hybrid_threshold };
+        for (int i = 0; i < 3; i++)
+        {
+            if (!std::isfinite(thresholds[i]) || thresholds[i] < 0.f)
+                return false;
+        }
+
+        if (config.tta_threshold > 0.f && config.tta < 4)
+            return false;
+
+        config.tile_w = config.tile_w ? config.tile_w : default_tile;
+        config.tile_h = config.tile_h ? config.tile_h : default_tile;
+        config.tta_stream = config.tta_stream || config.tta_threshold > 0.f;
+        config.fp32 = !!config.fp32;
+        config.flat_skip = !!config.flat_skip;
+        config.deterministic = !!config.deterministic;
+        config.flat_threshold = config.flat_skip ? config.flat_threshold : 0.f;
+        config.hybrid_threshold = config.model == 3 ? config.hybrid_threshold : 0.f;
+
+        return true;
+    }
+
+    // unloads the least recently used engines no frame is running on until there is room for one more
+    void evict_idle()
+    {
+        while ((int)engines.size() >= max_engines)
+        {
+            std::map<std::string, Entry>::iterator oldest = engines.end();
+            for (std::map<std::string, Entry>::iterator it = engines.begin(); it != engines.end(); ++it)
+            {
+                // held by the registry alone, copies are only handed out under the lock
+                if (it->second.engine.use_count() == 1 && (oldest == engines.end() || it->second.last_used < oldest->second.last_used))
+                    oldest = it;
+            }
+
+            if (oldest == engines.end())
+                break;
+
+            const Waifu2xEngineConfig& config = *(const Waifu2xEngineConfig*)oldest->first.data();
+            fprintf(stderr, "unloaded model=%d noise=%d scale=%d tta=%d fp32=%d deterministic=%d\n",
+                    config.model, config.noise, config.scale, config.tta, config.fp32, config.deterministic);
+
+            engines.erase(oldest);
+        }
+    }
+
+    std::shared_ptr<Waifu2x> create(const Waifu2xEngineConfig& config) const
+    {
+        std::string model_dir = models_dir;
+        int prepadding = 0;
+        switch (config.model)
+        {
+        case 0:
+            model_dir += "/models-upconv_7_anime_style_art_rgb";
+            prepadding = 7;
+            break;
+        case 1:
+            model_dir += "/models-upconv_7_photo";
+            prepadding = 7;
+            break;
+        default:
+            model_dir += "/models-cunet";
+            prepadding = (config.noise == -1 || config.scale > 1) ? 18 : 28;
+            break;
+        }
+
+        const std::string noise = std::to_string(config.noise);
+        const std::string model_name = config.noise == -1 ? "scale2.0x_model" : config.scale == 1 ? "noise" + noise + "_model" : "noise" + noise + "_scale2.0x_model";
+        const std::string parampath = model_dir + "/" + model_name + ".param";
+        const std::string modelpath = model_dir + "/" + model_name + ".bin";
+        const std::string fast_parampath = models_dir + "/models-upconv_7_anime_style_art_rgb/" + model_name + ".param";
+        const std::string fast_modelpath = models_dir + "/models-upconv_7_anime_style_art_rgb/" + model_name + ".bin";
+
+        if (!file_exists(parampath) || (config.model == 3 && !file_exists(fast_parampath)))
+        {
+            fprintf(stderr, "failed to load model %s\n", parampath.c_str());
+            return std::shared_ptr<Waifu2x>();
+        }
+
+        std::shared_ptr<Waifu2x> engine(new Waifu2x(gpuid, config.tta, 1, config.tta_stream));
+
+        engine->noise = config.noise;
+        engine->scale = config.scale;
+        engine->tile_w = config.tile_w;
+        engine->tile_h = config.tile_h;
+        engine->prepadding = prepadding;
+        engine->tta_threshold = config.tta_threshold;
+        engine->target_width = config.target_width;
+        engine->target_height = config.target_height;
+        engine->tile_reuse = false;
+        engine->tile_reuse_threshold = 0.f;
+        engine->flat_skip = config.flat_skip;
+        engine->flat_threshold = config.flat_threshold;
+        engine->hybrid = config.model == 3;
+        engine->hybrid_threshold = config.hybrid_threshold;
+        engine->prepadding_fast = 7;
+        engine->deterministic = config.deterministic;
+
+        engine->load(parampath, modelpath, config.fp32);
+
+        if (config.model == 3)
+            engine->load_fast(fast_parampath, fast_modelpath);
+
+        if (config.deterministic && engine->tile_memory() > engine->device_memory())
+        {
+            fprintf(stderr, "a deterministic tile of %dx%d does not fit in gpu memory\n", config.tile_w, config.tile_h);
+            return std::shared_ptr<Waifu2x>();
+        }
+
+        return engine;
+    }
+
+    static bool file_exists(const std::string& path)
+    {
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (!fp)
+            return false;
+
+        fclose(fp);
+        return true;
+    }
+
+private:
+    const int gpuid;
+    const int default_tile;
+    const std::string models_dir;
+    const int max_engines;
+
+    std::counting_semaphore<> gpu_slots;
+
+    std::mutex lock;
+    uint64_t clock;
+    std::map<std::string, Entry> engines;
+};
+
+// requests of all clients are taken from one queue in arrival order, so no client starves the others
+static void serve(shmipc::Server& server, EngineRegistry& engines)
+{
+    while (!stop_requested)
+    {
+        shmipc::Request request;
+        if (!server.wait_request(request, 1000))
+        {
+            server.sweep();
+            continue;
+        }
+
+        const float* in = (const float*)request.data->data;
+        float* out = (float*)request.data->data + (size_t)request.w * request.h * 3;
+
+        Waifu2xStats stats;
+        int status = engines.process(request.config, in, out, request.w, request.h, request.out_w, request.out_h, stats);
+
+        server.finish(request, status, stats);
+    }
+}
+
+// one thread per connection, a client keeps as many connections as it has frames in flight
+static void serve_connection(int fd, EngineRegistry& engines, const size_t max_pixels)
+{
+    netipc::Request request;
+    std::vector<float> out;
+    while (netipc::read_request(fd, request, max_pixels))
+    {
+        out.resize((size_t)request.out_w * request.out_h * 3);
+
+        Waifu2xStats stats;
+        int status = engines.process(request.config, request.in.data(), out.data(), request.w, request.h, request.out_w, request.out_h, stats);
+
+        if (!netipc::write_reply(fd, request, status, stats, out.data()))
+            break;
+    }
+}
+
+static void serve_tcp(netipc::Server& server, EngineRegistry& engines, const int max_connections, const int io_timeout_ms, const size_t max_pixels)
+{
+    // the socket is closed here once its thread is joined, so shutdown never hits a reused descriptor
+    struct Connection
+    {
+        int fd;
+        std::atomic<bool> done;
+        std::thread thread;
+    };
+    std::list<std::unique_ptr<Connection> > connections;
+
+    while (!stop_requested)
+    {
+        int fd = server.accept(1000, io_timeout_ms);
+
+        // reap the connections whose clients hung up
+        for (std::list<std::unique_ptr<Connection> >::iterator it = connections.begin(); it != connections.end();)
+        {
+            if (!(*it)->done)
+            {
+                ++it;
+                continue;
+            }
+
+            (*it)->thread.join();
+            close((*it)->fd);
+            it = connections.erase(it);
+        }
+
+        if (fd < 0)
+            continue;
+
+        if ((int)connections.size() >= max_connections)
+        {
+            close(fd);
+            continue;
+        }
+
+        std::unique_ptr<Connection> connection(new Connection);
+        connection->fd = fd;
+        connection->done = false;
+
+        Connection* c = connection.get();
+        connection->thread = std::thread([c, &engines, max_pixels]() {
+            serve_connection(c->fd, engines, max_pixels);
+            c->done = true;
+        });
+
+        connections.push_back(std::move(connection));
+    }
+
+    // wake the connections blocked on their clients
+    for (std::list<std::unique_ptr<Connection> >::iterator it = connections.begin(); it != connections.end(); ++it)
+        shutdown((*it)->fd, SHUT_RDWR);
+
+    for (std::list<std::unique_ptr<Connection> >::iterator it = connections.begin(); it != connections.end(); ++it)
+    {
+        (*it)->thread.join();
+        close((*it)->fd);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string name = "w2xncnnvk";
+    int gpuid = -2;
+    int threads = 2;
+    int tile = 400;
+    std::string models_dir = WAIFU2X_MODELS_DIR;
+    int port = 0;
+    int max_engines = 4;
+    std::string address = "127.0.0.1";
+    int max_connections = 16;
+    int io_timeout = 60;
+    int max_megapixels = 134;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : 0;
+
+        if (strcmp(arg, "-h") == 0)
+        {
+            print_usage();
+            return 0;
+        }
+
+        if (!value || arg[0] != '-' || strlen(arg) != 2 || !strchr("ngjtmpebcws", arg[1]))
+        {
+            print_usage();
+            return -1;
+        }
+
+        switch (arg[1])
+        {
+        case 'n':
+            name = value;
+            break;
+        case 'g':
+            gpuid = atoi(value);
+            break;
+        case 'j':
+            threads = atoi(value);
+            break;
+        case 't':
+            tile = atoi(value);
+            break;
+        case 'm':
+            models_dir = value;
+            break;
+        case 'p':
+            port = atoi(value);
+            break;
+        case 'e':
+            max_engines = atoi(value);
+            break;
+        case 'b':
+            address = value;
+            break;
+        case 'c':
+            max_connections = atoi(value);
+            break;
+        case 'w':
+            io_timeout = atoi(value);
+            break;
+        case 's':
+            max_megapixels = atoi(value);
+            break;
+        }
+
+        i++;
+    }
+
+    if (name.empty() || name.find('/') != std::string::npos || threads < 1 || tile < 32 || port < 0 || port > 65535 || max_engines < 1 || max_connections < 1
+            || io_timeout < 1 || io_timeout > 86400 || max_megapixels < 1 || max_megapixels > 4096)
+    {
+        print_usage();
+        return -1;
+    }
+
+    if (ncnn::create_gpu_instance() != 0)
+    {
+        fprintf(stderr, "failed to create GPU instance\n");
+        return -1;
+    }
+
+    if (gpuid == -2)
+        gpuid = ncnn::get_default_gpu_index();
+
+    if (gpuid < 0 || gpuid >= ncnn::get_gpu_count())
+    {
+        fprintf(stderr, "invalid gpu device\n");
+        ncnn::destroy_gpu_instance();
+        return -1;
+    }
+
+    threads = std::min(threads, (int)ncnn::get_gpu_info(gpuid).compute_queue_count());
+
+    int ret = 0;
+    {
+        shmipc::Server server;
+        netipc::Server tcp_server;
+        if (server.create(name) != 0)
+        {
+            fprintf(stderr, "another daemon is serving %s\n", name.c_str());
+            ret = -1;
+        }
+        else if (port && tcp_server.listen(address, port) != 0)
+        {
+            fprintf(stderr, "failed to listen on %s port %d\n", address.c_str(), port);
+            ret = -1;
+        }
+        else
+        {
+            signal(SIGINT, on_signal);
+            signal(SIGTERM, on_signal);
+
+            fprintf(stderr, "serving %s on %s with %d threads\n", name.c_str(), ncnn::get_gpu_info(gpuid).device_name(), threads);
+
+            EngineRegistry engines(gpuid, tile, models_dir, threads, max_engines);
+
+            std::vector<std::thread> workers;
+            for (int i = 0; i < threads; i++)
+                workers.emplace_back(serve, std::ref(server), std::ref(engines));
+
+            if (port)
+            {
+                fprintf(stderr, "listening on %s port %d\n", address.c_str(), port);
+                workers.emplace_back(serve_tcp, std::ref(tcp_server), std::ref(engines), max_connections, io_timeout * 1000, (size_t)max_megapixels * 1000000);
+            }
+
+            for (size_t i = 0; i < workers.size(); i++)
+                workers[i].join();
+        }
+    }
+
+    ncnn::destroy_gpu_instance();
+
+    return ret;
+}
@@ -0,0 +1,403 @@
+// content-keyed caches of upscaled frames
+
+#include "framecache.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+// reference xxHash64 for little endian hosts
+static uint64_t xxh64(const void* data, size_t len, uint64_t seed)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* const end = p + len;
+
+    uint64_t h64;
+
+    if (len >= 32)
+    {
+        const unsigned char* const limit = end - 32;
+
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do
+        {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h64 = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h64 = xxh64_merge_round(h64, v1);
+        h64 = xxh64_merge_round(h64, v2);
+        h64 = xxh64_merge_round(h64, v3);
+        h64 = xxh64_merge_round(h64, v4);
+    }
+    else
+    {
+        h64 = seed + PRIME64_5;
+    }
+
+    h64 += (uint64_t)len;
+
+    while (p + 8 <= end)
+    {
+        h64 ^= xxh64_round(0, read64(p));
+        h64 = rotl64(h64, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end)
+    {
+        h64 ^= (uint64_t)read32(p) * PRIME64_1;
+        h64 = rotl64(h64, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end)
+    {
+        h64 ^= (*p) * PRIME64_5;
+        h64 = rotl64(h64, 11) * PRIME64_1;
+        p++;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= PRIME64_3;
+    h64 ^= h64 >> 32;
+
+    return h64;
+}
+
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed)
+{
+    return xxh64(data, len, seed);
+}
+
+uint64_t hash_planes(const float* srcR, const float* srcG, const float* srcB,
+                     const int w, const int h, const ptrdiff_t stride)
+{
+    // each row is chained through the seed, starting from the frame size
+    uint64_t hash = ((uint64_t)w << 32) | (uint32_t)h;
+
+    const float* planes[3] = { srcR, srcG, srcB };
+    for (int c = 0; c < 3; c++)
+    {
+        for (int y = 0; y < h; y++)
+        {
+            hash = xxh64(planes[c] + y * stride, w * sizeof(float), hash);
+        }
+    }
+
+    return hash;
+}
+
+FrameCache::FrameCache(size_t _max_bytes)
+{
+    max_bytes = _max_bytes;
+    bytes = 0;
+    hit_count = 0;
+    miss_count = 0;
+}
+
+bool FrameCache::get(uint64_t key, float* dstR, float* dstG, float* dstB,
+                     const int w, const int h, const ptrdiff_t stride)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto it = index.find(key);
+    if (it == index.end() || it->second->data.size() != (size_t)w * h * 3)
+    {
+        miss_count++;
+        return false;
+    }
+
+    hit_count++;
+
+    // move to the front
+    entries.splice(entries.begin(), entries, it->second);
+
+    const float* data = it->second->data.data();
+    float* planes[3] = { dstR, dstG, dstB };
+    for (int c = 0; c < 3; c++)
+    {
+        for (int y = 0; y < h; y++)
+        {
+            std::memcpy(planes[c] + y * stride, data, w * sizeof(float));
+            data += w;
+        }
+    }
+
+    return true;
+}
+
+void FrameCache::put(uint64_t key, const float* srcR, const float* srcG, const float* srcB,
+                     const int w, const int h, const ptrdiff_t stride)
+{
+    const size_t size = (size_t)w * h * 3 * sizeof(float);
+    if (size > max_bytes)
+        return;
+
+    Entry entry;
+    entry.key = key;
+    entry.data.resize((size_t)w * h * 3);
+
+    float* data = entry.data.data();
+    const float* planes[3] = { srcR, srcG, srcB };
+    for (int c = 0; c < 3; c++)
+    {
+        for (int y = 0; y < h; y++)
+        {
+            std::memcpy(data, planes[c] + y * stride, w * sizeof(float));
+            data += w;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    // another thread may have upscaled the same content meanwhile
+    if (index.find(key) != index.end())
+        return;
+
+    while (bytes + size > max_bytes && !entries.empty())
+    {
+        bytes -= entries.back().data.size() * sizeof(float);
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+
+    entries.push_front(std::move(entry));
+    index[key] = entries.begin();
+    bytes += size;
+}
+
+int64_t FrameCache::hits() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return hit_count;
+}
+
+int64_t FrameCache::misses() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return miss_count;
+}
+
+struct DiskCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    int32_t w;
+    int32_t h;
+    uint64_t key;
+};
+
+static const char disk_cache_magic[4] = { 'W', '2', 'X', 'C' };
+static const uint32_t disk_cache_version = 1;
+
+// cache paths are utf-8, like every other path the plugin gets from vapoursynth
+static std::filesystem::path u8path(const std::string& s)
+{
+    return std::filesystem::path(std::u8string(s.begin(), s.end()));
+}
+
+DiskCache::DiskCache(const std::string& _dir, uint64_t _salt)
+{
+    dir = _dir;
+    salt = _salt;
+
+    std::error_code ec;
+    std::filesystem::create_directories(u8path(dir), ec);
+}
+
+std::string DiskCache::path(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.w2x", (unsigned long long)key);
+    return dir + "/" + name;
+}
+
+bool DiskCache::get(uint64_t key, float* dstR, float* dstG, float* dstB,
+                    const int w, const int h, const ptrdiff_t stride) const
+{
+    key = hash_bytes(&key, sizeof(key), salt);
+
+    const size_t size = sizeof(DiskCacheHeader) + (size_t)w * h * 3 * sizeof(float);
+    const std::filesystem::path filepath = u8path(path(key));
+
+#if _WIN32
+    HANDLE file = CreateFileW(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || (uint64_t)file_size.QuadPart != size)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+
+    const void* map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+    CloseHandle(mapping);
+    if (!map)
+        return false;
+#else
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != size)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    madvise(map, size, MADV_SEQUENTIAL);
+#endif
+
+    const DiskCacheHeader* header = (const DiskCacheHeader*)map;
+
+    const bool valid = memcmp(header->magic, disk_cache_magic, sizeof(disk_cache_magic)) == 0
+                       && header->version == disk_cache_version
+                       && header->w == w && header->h == h && header->key == key;
+
+    if (valid)
+    {
+        const float* data = (const float*)(header + 1);
+        float* planes[3] = { dstR, dstG, dstB };
+        for (int c = 0; c < 3; c++)
+        {
+            for (int y = 0; y < h; y++)
+            {
+                std::memcpy(planes[c] + y * stride, data, w * sizeof(float));
+                data += w;
+            }
+        }
+    }
+
+#if _WIN32
+    UnmapViewOfFile(map);
+#else
+    munmap(map, size);
+#endif
+
+    return valid;
+}
+
+void DiskCache::put(uint64_t key, const float* srcR, const float* srcG, const float* srcB,
+                    const int w, const int h, const ptrdiff_t stride) const
+{
+    key = hash_bytes(&key, sizeof(key), salt);
+
+    DiskCacheHeader header;
+    std::memcpy(header.magic, disk_cache_magic, sizeof(disk_cache_magic));
+    header.version = disk_cache_version;
+    header.w = w;
+    header.h = h;
+    header.key = key;
+
+    // unique across threads and processes sharing the directory
+    static std::atomic<uint64_t> counter{ std::random_device{}() };
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%016llx.tmp", (unsigned long long)counter++);
+
+    const std::filesystem::path filepath = u8path(path(key));
+    const std::filesystem::path tmppath = u8path(path(key) + suffix);
+
+    {
+        std::ofstream ofs(tmppath, std::ios::binary | std::ios::trunc);
+        if (!ofs.is_open())
+            return;
+
+        ofs.write((const char*)&header, sizeof(header));
+
+        const float* planes[3] = { srcR, srcG, srcB };
+        for (int c = 0; c < 3; c++)
+        {
+            for (int y = 0; y < h; y++)
+            {
+                ofs.write((const char*)(planes[c] + y * stride), w * sizeof(float));
+            }
+        }
+
+        if (!ofs.good())
+        {
+            ofs.close();
+            std::error_code ec;
+            std::filesystem::remove(tmppath, ec);
+            return;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmppath, filepath, ec);
+    if (ec)
+        std::filesystem::remove(tmppath, ec);
+}
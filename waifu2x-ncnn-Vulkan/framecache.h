@@ -0,0 +1,75 @@
+// content-keyed caches of upscaled frames
+
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed);
+
+// xxHash64 of the three planes, row by row so that stride padding is ignored
+uint64_t hash_planes(const float* srcR, const float* srcG, const float* srcB,
+                     const int w, const int h, const ptrdiff_t stride);
+
+// in-memory least recently used cache of output frames, bounded in bytes
+class FrameCache
+{
+public:
+    FrameCache(size_t max_bytes);
+
+    // copies a cached frame into dst, returns false on a miss
+    bool get(uint64_t key, float* dstR, float* dstG, float* dstB,
+             const int w, const int h, const ptrdiff_t stride);
+
+    void put(uint64_t key, const float* srcR, const float* srcG, const float* srcB,
+             const int w, const int h, const ptrdiff_t stride);
+
+public:
+    int64_t hits() const;
+    int64_t misses() const;
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        std::vector<float> data;
+    };
+
+    size_t max_bytes;
+    size_t bytes;
+    int64_t hit_count;
+    int64_t miss_count;
+
+    mutable std::mutex lock;
+    std::list<Entry> entries;// most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+};
+
+// on-disk cache of output frames, one memory mapped file per key
+class DiskCache
+{
+public:
+    // salt identifies the model and settings, it is mixed into every key
+    DiskCache(const std::string& dir, uint64_t salt);
+
+    bool get(uint64_t key, float* dstR, float* dstG, float* dstB,
+             const int w, const int h, const ptrdiff_t stride) const;
+
+    // written to a temporary file first and renamed, so readers never see a partial frame
+    void put(uint64_t key, const float* srcR, const float* srcG, const float* srcB,
+             const int w, const int h, const ptrdiff_t stride) const;
+
+private:
+    std::string path(uint64_t key) const;
+
+    std::string dir;
+    uint64_t salt;
+};
+
+#endif // FRAMECACHE_H
@@ -0,0 +1,487 @@
+// frames handed between the plugin and w2xncnnvk-daemon over tcp, for encode and gpu nodes on different machines
+
+#include "netipc.h"
+
+#if !_WIN32
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// ncnn
+#include "mat.h"
+
+namespace netipc {
+
+// the headers go over the wire as they are, both ends are expected to be little endian
+static const uint32_t request_magic = 0x77327871;
+static const uint32_t reply_magic = 0x77327872;
+static const uint32_t net_version = 2;
+
+// larger frames are refused rather than allocated
+static const int max_side = 65536;
+
+// samples go through the socket this many bytes at a time on the daemon side
+static const size_t chunk_bytes = (size_t)1 << 20;
+
+struct RequestHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t encoding;
+    Waifu2xEngineConfig config;
+    int32_t w;
+    int32_t h;
+    int32_t out_w;
+    int32_t out_h;
+};
+
+struct ReplyHeader
+{
+    uint32_t magic;
+    int32_t status;
+    int32_t tiles;
+    int32_t tta_escalated;
+    int32_t tiles_reused;
+    int32_t tiles_flat;
+    int32_t tiles_fast;
+};
+
+static size_t sample_size(const int encoding)
+{
+    return encoding == encoding_fp32 ? 4 : 2;
+}
+
+static bool send_all(const int fd, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= (size_t)n;
+    }
+
+    return true;
+}
+
+static bool recv_all(const int fd, void* data, size_t size)
+{
+    char* p = (char*)data;
+    while (size)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= (size_t)n;
+    }
+
+    return true;
+}
+
+// appends a w x h plane with stride in the wire encoding
+static void encode_plane(const float* src, const ptrdiff_t stride, const int w, const int h, const int encoding, unsigned char* dst)
+{
+    for (int y = 0; y < h; y++)
+    {
+        const float* row = src + y * stride;
+
+        if (encoding == encoding_fp32)
+        {
+            memcpy(dst + (size_t)y * w * 4, row, (size_t)w * 4);
+        }
+        else if (encoding == encoding_fp16)
+        {
+            unsigned short* out = (unsigned short*)dst + (size_t)y * w;
+            for (int x = 0; x < w; x++)
+                out[x] = ncnn::float32_to_float16(row[x]);
+        }
+        else
+        {
+            unsigned short* out = (unsigned short*)dst + (size_t)y * w;
+            for (int x = 0; x < w; x++)
+                out[x] = (unsigned short)(std::min(std::max(row[x], 0.f), 1.f) * 65535.f + 0.5f);
+        }
+    }
+}
+
+static void decode_plane(const unsigned char* src, const int w, const int h, const int encoding, float* dst, const ptrdiff_t stride)
+{
+    for (int y = 0; y < h; y++)
+    {
+        float* row = dst + y * stride;
+
+        if (encoding == encoding_fp32)
+        {
+            memcpy(row, src + (size_t)y * w * 4, (size_t)w * 4);
+        }
+        else if (encoding == encoding_fp16)
+        {
+            const unsigned short* in = (const unsigned short*)src + (size_t)y * w;
+            for (int x = 0; x < w; x++)
+                row[x] = ncnn::float16_to_float32(in[x]);
+        }
+        else
+        {
+            const unsigned short* in = (const unsigned short*)src + (size_t)y * w;
+            for (int x = 0; x < w; x++)
+                row[x] = in[x] * (1.f / 65535.f);
+        }
+    }
+}
+
+Client::Client()
+{
+    encoding = encoding_fp32;
+}
+
+Client::~Client()
+{
+    for (size_t i = 0; i < idle.size(); i++)
+        close(idle[i]);
+}
+
+int Client::connect(const std::string& address, int _encoding)
+{
+    const size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == address.size())
+        return -1;
+
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    encoding = _encoding;
+
+    // [::1]:port
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    int fd = open_connection();
+    if (fd < 0)
+        return -1;
+
+    release_connection(fd);
+    return 0;
+}
+
+int Client::open_connection()
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* result = 0;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0)
+        return -1;
+
+    int fd = -1;
+    for (addrinfo* ai = result; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+
+    if (fd >= 0)
+    {
+        // the header of a request must not wait for the planes behind it
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    return fd;
+}
+
+int Client::acquire_connection()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!idle.empty())
+        {
+            int fd = idle.back();
+            idle.pop_back();
+            return fd;
+        }
+    }
+
+    return open_connection();
+}
+
+void Client::release_connection(int fd)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    idle.push_back(fd);
+}
+
+int Client::process(const Waifu2xEngineConfig& config,
+                    const float* srcR, const float* srcG, const float* srcB,
+                    float* dstR, float* dstG, float* dstB,
+                    const int w, const int h, const int out_w, const int out_h,
+                    const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                    Waifu2xStats* stats)
+{
+    const size_t in_plane = (size_t)w * h * sample_size(encoding);
+    const size_t out_plane = (size_t)out_w * out_h * sample_size(encoding);
+
+    RequestHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = request_magic;
+    header.version = net_version;
+    header.encoding = encoding;
+    header.config = config;
+    header.w = w;
+    header.h = h;
+    header.out_w = out_w;
+    header.out_h = out_h;
+
+    std::vector<unsigned char> data(std::max(in_plane, out_plane) * 3);
+    encode_plane(srcR, srcStride, w, h, encoding, data.data());
+    encode_plane(srcG, srcStride, w, h, encoding, data.data() + in_plane);
+    encode_plane(srcB, srcStride, w, h, encoding, data.data() + in_plane * 2);
+
+    // an idle connection may have been closed by a restarted daemon, the second try is on a new one
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int fd = attempt == 0 ? acquire_connection() : open_connection();
+        if (fd < 0)
+            return -1;
+
+        ReplyHeader reply;
+        if (!send_all(fd, &header, sizeof(header)) || !send_all(fd, data.data(), in_plane * 3) || !recv_all(fd, &reply, sizeof(reply)) || reply.magic != reply_magic)
+        {
+            close(fd);
+            continue;
+        }
+
+        if (reply.status == 0 && !recv_all(fd, data.data(), out_plane * 3))
+        {
+            close(fd);
+            return -1;
+        }
+
+        release_connection(fd);
+
+        if (stats)
+        {
+            stats->tiles = reply.tiles;
+            stats->tta_escalated = reply.tta_escalated;
+            stats->tiles_reused = reply.tiles_reused;
+            stats->tiles_flat = reply.tiles_flat;
+            stats->tiles_fast = reply.tiles_fast;
+        }
+
+        if (reply.status != 0)
+            return -1;
+
+        decode_plane(data.data(), out_w, out_h, encoding, dstR, dstStride);
+        decode_plane(data.data() + out_plane, out_w, out_h, encoding, dstG, dstStride);
+        decode_plane(data.data() + out_plane * 2, out_w, out_h, encoding, dstB, dstStride);
+
+        return 0;
+    }
+
+    return -1;
+}
+
+Server::Server()
+{
+    fd = -1;
+}
+
+Server::~Server()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+int Server::listen(const std::string& address, int port)
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    addrinfo* result = 0;
+    if (getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+        return -1;
+
+    for (addrinfo* ai = result; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        // :: takes ipv4 clients too
+        if (ai->ai_family == AF_INET6)
+        {
+            int zero = 0;
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+        }
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, 64) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+
+    return fd >= 0 ? 0 : -1;
+}
+
+int Server::accept(int timeout_ms, int io_timeout_ms)
+{
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return -1;
+
+    int client = ::accept(fd, 0, 0);
+    if (client < 0)
+        return -1;
+
+    int one = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    timeval timeout;
+    timeout.tv_sec = io_timeout_ms / 1000;
+    timeout.tv_usec = (io_timeout_ms % 1000) * 1000;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    return client;
+}
+
+bool read_request(int fd, Request& request, size_t max_pixels)
+{
+    RequestHeader header;
+    if (!recv_all(fd, &header, sizeof(header)))
+        return false;
+
+    if (header.magic != request_magic || header.version != net_version)
+        return false;
+
+    if (header.encoding != encoding_fp32 && header.encoding != encoding_fp16 && header.encoding != encoding_int16)
+        return false;
+
+    if (header.w <= 0 || header.h <= 0 || header.w > max_side || header.h > max_side)
+        return false;
+
+    // the output size follows from the config, so the reply buffer cannot be asked for separately
+    const Waifu2xEngineConfig& config = header.config;
+    if (config.scale != 1 && config.scale != 2 && config.scale != 4 && config.scale != 8)
+        return false;
+
+    if (header.out_w != (config.target_width ? config.target_width : header.w * config.scale)
+            || header.out_h != (config.target_height ? config.target_height : header.h * config.scale))
+        return false;
+
+    if (header.out_w <= 0 || header.out_h <= 0 || header.out_w > max_side * 8 || header.out_h > max_side * 8
+            || (size_t)header.w * header.h > max_pixels || (size_t)header.out_w * header.out_h > max_pixels)
+        return false;
+
+    request.config = header.config;
+    request.w = header.w;
+    request.h = header.h;
+    request.out_w = header.out_w;
+    request.out_h = header.out_h;
+    request.encoding = header.encoding;
+
+    // decoded a few rows at a time as they arrive, so memory is only taken for samples actually received
+    const size_t row_bytes = (size_t)header.w * sample_size(header.encoding);
+    const int chunk_rows = (int)std::max(chunk_bytes / row_bytes, (size_t)1);
+
+    request.in.clear();
+    for (int q = 0; q < 3; q++)
+    {
+        for (int y = 0; y < header.h; y += chunk_rows)
+        {
+            const int rows = std::min(chunk_rows, header.h - y);
+
+            request.buffer.resize(row_bytes * rows);
+            if (!recv_all(fd, request.buffer.data(), request.buffer.size()))
+                return false;
+
+            const size_t offset = request.in.size();
+            request.in.resize(offset + (size_t)header.w * rows);
+            decode_plane(request.buffer.data(), header.w, rows, header.encoding, request.in.data() + offset, header.w);
+        }
+    }
+
+    return true;
+}
+
+bool write_reply(int fd, Request& request, int status, const Waifu2xStats& stats, const float* out)
+{
+    ReplyHeader reply;
+    reply.magic = reply_magic;
+    reply.status = status;
+    reply.tiles = stats.tiles;
+    reply.tta_escalated = stats.tta_escalated;
+    reply.tiles_reused = stats.tiles_reused;
+    reply.tiles_flat = stats.tiles_flat;
+    reply.tiles_fast = stats.tiles_fast;
+
+    if (!send_all(fd, &reply, sizeof(reply)))
+        return false;
+
+    if (status != 0)
+        return true;
+
+    // encoded through the same buffer a few rows at a time
+    const size_t plane = (size_t)request.out_w * request.out_h;
+    const size_t row_bytes = (size_t)request.out_w * sample_size(request.encoding);
+    const int chunk_rows = (int)std::max(chunk_bytes / row_bytes, (size_t)1);
+
+    for (int q = 0; q < 3; q++)
+    {
+        for (int y = 0; y < request.out_h; y += chunk_rows)
+        {
+            const int rows = std::min(chunk_rows, request.out_h - y);
+
+            request.buffer.resize(row_bytes * rows);
+            encode_plane(out + plane * q + (size_t)y * request.out_w, request.out_w, request.out_w, rows, request.encoding, request.buffer.data());
+
+            if (!send_all(fd, request.buffer.data(), request.buffer.size()))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+} // namespace netipc
+#endif // !_WIN32
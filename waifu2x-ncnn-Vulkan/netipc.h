@@ -0,0 +1,100 @@
+// frames handed between the plugin and w2xncnnvk-daemon over tcp, for encode and gpu nodes on different machines
+
+#ifndef NETIPC_H
+#define NETIPC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "shmipc.h"
+
+#if !_WIN32
+namespace netipc {
+
+// sample encoding on the wire, both ways
+enum
+{
+    encoding_fp32 = 0,
+    encoding_fp16 = 1,
+    encoding_int16 = 2// 0.0-1.0 in 65536 steps, samples outside are clamped
+};
+
+// sends frames to a daemon, one connection per frame in flight, thread safe
+class Client
+{
+public:
+    Client();
+    ~Client();
+
+    // host:port, 0 on success, -1 if the daemon cannot be reached
+    int connect(const std::string& address, int encoding);
+
+    // same as shmipc::Client::process
+    int process(const Waifu2xEngineConfig& config,
+                const float* srcR, const float* srcG, const float* srcB,
+                float* dstR, float* dstG, float* dstB,
+                const int w, const int h, const int out_w, const int out_h,
+                const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                Waifu2xStats* stats);
+
+private:
+    int open_connection();
+    int acquire_connection();
+    void release_connection(int fd);
+
+private:
+    std::string host;
+    std::string port;
+    int encoding;
+
+    std::mutex lock;
+    std::vector<int> idle;
+};
+
+// request as seen by the daemon, the planes decoded to packed fp32
+struct Request
+{
+    Waifu2xEngineConfig config;
+    int w;
+    int h;
+    int out_w;
+    int out_h;
+    int encoding;
+    std::vector<float> in;
+
+    // wire samples on their way in or out, kept for the next request on the connection
+    std::vector<unsigned char> buffer;
+};
+
+// listening socket of the daemon
+class Server
+{
+public:
+    Server();
+    ~Server();
+
+    // address is numeric or a host name, :: or 0.0.0.0 for all interfaces, -1 on failure
+    int listen(const std::string& address, int port);
+
+    // connected socket, or -1 if none arrived within timeout_ms
+    // reads and writes on it fail once the client sends or takes nothing for io_timeout_ms, so idle and stalled clients give up their connection
+    int accept(int timeout_ms, int io_timeout_ms);
+
+private:
+    int fd;
+};
+
+// next request on a connection, false once the client hung up or sent garbage
+// frames with more than max_pixels pixels on either side are refused rather than allocated
+bool read_request(int fd, Request& request, size_t max_pixels);
+
+// reply to the last request, out holds out_w x out_h packed planes, ignored unless status is 0
+bool write_reply(int fd, Request& request, int status, const Waifu2xStats& stats, const float* out);
+
+} // namespace netipc
+#endif // !_WIN32
+
+#endif // NETIPC_H
@@ -0,0 +1,186 @@
+// host copies of frame planes
+
+#include "planecopy.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PLANECOPY_SSE2 1
+#endif
+
+// the build baseline stays sse2, avx and avx512 streaming copies are picked at runtime
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#include "cpu.h"
+#define PLANECOPY_X86_DISPATCH 1
+#endif
+
+// bytes per copy thread, below this a plane is copied by the calling thread alone
+static const size_t parallel_bytes = 8 << 20;
+
+// a few threads already saturate memory bandwidth
+static const int max_copy_threads = 4;
+
+#if PLANECOPY_X86_DISPATCH
+// one cache line per iteration, the tail is left to the sse2 loop
+__attribute__((target("avx")))
+static size_t stream_span_avx(const float* src, float* dst, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256 _p0 = _mm256_loadu_ps(src + i);
+        __m256 _p1 = _mm256_loadu_ps(src + i + 8);
+        _mm256_stream_ps(dst + i, _p0);
+        _mm256_stream_ps(dst + i + 8, _p1);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static size_t stream_span_avx512(const float* src, float* dst, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m512 _p0 = _mm512_loadu_ps(src + i);
+        __m512 _p1 = _mm512_loadu_ps(src + i + 16);
+        _mm512_stream_ps(dst + i, _p0);
+        _mm512_stream_ps(dst + i + 16, _p1);
+    }
+
+    return i;
+}
+
+// the widest streaming copy of the cpu and the destination alignment its stores need, no copy for the sse2 loop alone
+struct StreamSpan
+{
+    size_t (*copy)(const float* src, float* dst, const size_t n);
+    uintptr_t align;
+};
+
+static StreamSpan select_stream_span()
+{
+    if (ncnn::cpu_support_x86_avx512())
+        return { stream_span_avx512, 63 };
+
+    if (ncnn::cpu_support_x86_avx())
+        return { stream_span_avx, 31 };
+
+    return { 0, 15 };
+}
+
+static const StreamSpan& stream_span()
+{
+    static const StreamSpan span = select_stream_span();
+    return span;
+}
+#endif // PLANECOPY_X86_DISPATCH
+
+static void copy_span(const float* src, float* dst, size_t n, const bool stream)
+{
+#if PLANECOPY_SSE2
+    if (stream)
+    {
+        // streaming stores need an aligned destination
+#if PLANECOPY_X86_DISPATCH
+        const StreamSpan& span = stream_span();
+        const uintptr_t align = span.align;
+#else
+        const uintptr_t align = 15;
+#endif
+        while (n > 0 && ((uintptr_t)dst & align))
+        {
+            *dst++ = *src++;
+            n--;
+        }
+
+        size_t i = 0;
+#if PLANECOPY_X86_DISPATCH
+        if (span.copy)
+            i = span.copy(src, dst, n);
+#endif
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128 _p0 = _mm_loadu_ps(src + i);
+            __m128 _p1 = _mm_loadu_ps(src + i + 4);
+            __m128 _p2 = _mm_loadu_ps(src + i + 8);
+            __m128 _p3 = _mm_loadu_ps(src + i + 12);
+            _mm_stream_ps(dst + i, _p0);
+            _mm_stream_ps(dst + i + 4, _p1);
+            _mm_stream_ps(dst + i + 8, _p2);
+            _mm_stream_ps(dst + i + 12, _p3);
+        }
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm_stream_ps(dst + i, _mm_loadu_ps(src + i));
+        }
+        for (; i < n; i++)
+        {
+            dst[i] = src[i];
+        }
+
+        return;
+    }
+#else
+    (void)stream;
+#endif
+
+    std::memcpy(dst, src, n * sizeof(float));
+}
+
+// orders the streaming stores of the calling thread before anything that reads the plane on another thread
+static void stream_fence(const bool stream)
+{
+#if PLANECOPY_SSE2
+    if (stream)
+        _mm_sfence();
+#else
+    (void)stream;
+#endif
+}
+
+void copy_plane(const float* src, const ptrdiff_t src_stride, float* dst, const ptrdiff_t dst_stride,
+                const int w, const int h, const bool stream, const bool parallel)
+{
+    if (w <= 0 || h <= 0)
+        return;
+
+    const size_t total = (size_t)w * h;
+    const int threads = parallel ? (int)std::clamp(total * sizeof(float) / parallel_bytes, (size_t)1, (size_t)max_copy_threads) : 1;
+
+    if (src_stride == w && dst_stride == w)
+    {
+        // one piece per thread, in whole cache lines
+        const size_t chunk = ((total + threads - 1) / threads + 15) & ~(size_t)15;
+
+        #pragma omp parallel for num_threads(threads) if(threads > 1)
+        for (int i = 0; i < threads; i++)
+        {
+            const size_t begin = i * chunk;
+            if (begin < total)
+            {
+                copy_span(src + begin, dst + begin, std::min(chunk, total - begin), stream);
+                stream_fence(stream);
+            }
+        }
+
+        return;
+    }
+
+    // one fence per thread after all of its rows
+    #pragma omp parallel num_threads(threads) if(threads > 1)
+    {
+        #pragma omp for
+        for (int y = 0; y < h; y++)
+        {
+            copy_span(src + y * src_stride, dst + y * dst_stride, w, stream);
+        }
+
+        stream_fence(stream);
+    }
+}
@@ -0,0 +1,15 @@
+// host copies of frame planes
+
+#ifndef PLANECOPY_H
+#define PLANECOPY_H
+
+#include <cstddef>
+
+// copies w x h floats between planes, strides are in floats
+// planes without row padding are copied in one piece, large ones are split over a few threads,
+// and stream writes the destination with non-temporal stores, for output that is not read back soon
+// parallel false keeps the copy on the calling thread, for callers that are already a helper thread
+void copy_plane(const float* src, const ptrdiff_t src_stride, float* dst, const ptrdiff_t dst_stride,
+                const int w, const int h, const bool stream = false, const bool parallel = true);
+
+#endif // PLANECOPY_H
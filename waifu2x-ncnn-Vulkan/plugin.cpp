@@ -24,8 +24,10 @@
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <fstream>
 #include <memory>
+#include <mutex>
 #include <semaphore>
 #include <string>
 #include <vector>
@@ -33,20 +35,261 @@
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
 
+#include "framecache.h"
+#include "netipc.h"
+#include "shmipc.h"
 #include "waifu2x.h"
 
 using namespace std::literals;
 
 static std::atomic<int> numGPUInstances{ 0 };
 
+// picks the engine of each frame for cpu_assist from moving averages of the measured frame times,
+// a frame only goes to the cpu when it is expected to be done no later than behind the frames already queued on the gpu
+class WorkSplit final {
+public:
+    explicit WorkSplit(const int gpuThreads) noexcept : gpuThreads{ gpuThreads } {}
+
+    bool acquire() noexcept {
+        std::lock_guard lock{ mutex };
+
+        // rounds of gpu_thread frames until a new gpu frame would be done
+        auto gpuRounds{ (gpuBusy + gpuThreads) / gpuThreads };
+
+        bool onCPU;
+        if (cpuBusy)
+            onCPU = false;
+        else if (cpuTime == 0.0)
+            onCPU = gpuBusy >= gpuThreads;
+        else
+            onCPU = gpuTime > 0.0 && cpuTime <= gpuRounds * gpuTime;
+
+        if (onCPU)
+            cpuBusy = true;
+        else
+            gpuBusy++;
+
+        return onCPU;
+    }
+
+    void release(const bool onCPU, const double seconds) noexcept {
+        std::lock_guard lock{ mutex };
+
+        auto& time{ onCPU ? cpuTime : gpuTime };
+        time = time == 0.0 ? seconds : time + (seconds - time) * 0.2;
+
+        if (onCPU) {
+            cpuBusy = false;
+            cpuFrames++;
+        } else {
+            gpuBusy--;
+            gpuFrames++;
+        }
+    }
+
+    double cpuShare() noexcept {
+        std::lock_guard lock{ mutex };
+        return cpuFrames + gpuFrames ? static_cast<double>(cpuFrames) / (cpuFrames + gpuFrames) : 0.0;
+    }
+
+private:
+    std::mutex mutex;
+    const int gpuThreads;
+    int gpuBusy{};
+    bool cpuBusy{};
+    double gpuTime{};
+    double cpuTime{};
+    int64_t gpuFrames{};
+    int64_t cpuFrames{};
+};
+
 struct Waifu2xData final {
     VSNode* node;
     VSVideoInfo vi;
     std::unique_ptr<Waifu2x> waifu2x;
     std::unique_ptr<std::counting_semaphore<>> semaphore;
+    std::unique_ptr<Waifu2x> waifu2xCPU;
+    std::unique_ptr<WorkSplit> split;
+#ifndef _WIN32
+    std::unique_ptr<shmipc::Client> remote;
+    std::unique_ptr<netipc::Client> netRemote;
+#endif
+    Waifu2xEngineConfig remoteConfig;
+    bool cpu;
+    bool gpuInstance;
+    int scale;
+    float ttaThreshold;
+    bool tileReuse;
+    int tileReuseInterval;
+    bool flatSkip;
+    bool hybrid;
+    int numThreads;
+    std::unique_ptr<FrameCache> cache;
+    std::unique_ptr<DiskCache> diskCache;
+    bool letterbox;
+    int letterboxMargin;
+    std::string uploadMemory;
+    std::string downloadMemory;
 };
 
-static void filter(const VSFrame* src, VSFrame* dst, const Waifu2xData* const VS_RESTRICT d, const VSAPI* vsapi) noexcept {
+// index and property flags of a memory type, so the staging memory a driver gave can be checked
+static std::string describeMemoryType(const int gpuId, const uint32_t index) {
+    auto flags{ ncnn::get_gpu_info(gpuId).physical_device_memory_properties().memoryTypes[index].propertyFlags };
+
+    auto text{ std::to_string(index) };
+    for (auto&& [bit, name] : { std::pair{ VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, "DEVICE_LOCAL" },
+                                std::pair{ VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, "HOST_VISIBLE" },
+                                std::pair{ VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, "HOST_COHERENT" },
+                                std::pair{ VK_MEMORY_PROPERTY_HOST_CACHED_BIT, "HOST_CACHED" } }) {
+        if (flags & bit)
+            text += " "s + name;
+    }
+
+    return text;
+}
+
+static bool isBlack(const float* srcR, const float* srcG, const float* srcB, const int x0, const int x1, const int y0, const int y1, const ptrdiff_t stride) noexcept {
+    for (auto y{ y0 }; y < y1; y++) {
+        for (auto x{ x0 }; x < x1; x++) {
+            if (srcR[y * stride + x] != 0.0f || srcG[y * stride + x] != 0.0f || srcB[y * stride + x] != 0.0f)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// bounds of the picture inside pure black borders, x0 == x1 if the whole frame is black
+// scanning stops at the first non-black sample from each side, so frames without borders only cost a few samples
+// checking a rect kept from an earlier frame would read the same border samples, so there is nothing to cache per scene
+static void detectActiveArea(const float* srcR, const float* srcG, const float* srcB, const int width, const int height, const ptrdiff_t stride,
+                             int& x0, int& y0, int& x1, int& y1) noexcept {
+    x0 = 0;
+    y0 = 0;
+    x1 = width;
+    y1 = height;
+
+    while (y0 < y1 && isBlack(srcR, srcG, srcB, 0, width, y0, y0 + 1, stride))
+        y0++;
+
+    if (y0 == y1) {
+        x1 = 0;
+        return;
+    }
+
+    while (isBlack(srcR, srcG, srcB, 0, width, y1 - 1, y1, stride))
+        y1--;
+
+    while (isBlack(srcR, srcG, srcB, x0, x0 + 1, y0, y1, stride))
+        x0++;
+
+    while (isBlack(srcR, srcG, srcB, x1 - 1, x1, y0, y1, stride))
+        x1--;
+}
+
+static void fillBlack(float* dst, const int x0, const int x1, const int y0, const int y1, const ptrdiff_t stride) noexcept {
+    for (auto y{ y0 }; y < y1; y++)
+        std::fill(dst + y * stride + x0, dst + y * stride + x1, 0.0f);
+}
+
+// returns whether the cpu engine of cpu_assist took the frame
+static bool upscale(const float* srcR, const float* srcG, const float* srcB, float* dstR, float* dstG, float* dstB,
+                    const int width, const int height, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                    const Waifu2xData* const VS_RESTRICT d, Waifu2xStats* stats, const Waifu2xReuse* reuse) {
+#ifndef _WIN32
+    if (d->remote || d->netRemote) {
+        auto outWidth{ d->remoteConfig.target_width ? d->remoteConfig.target_width : width * d->scale };
+        auto outHeight{ d->remoteConfig.target_height ? d->remoteConfig.target_height : height * d->scale };
+
+        d->semaphore->acquire();
+        auto ret{ d->remote ? d->remote->process(d->remoteConfig, srcR, srcG, srcB, dstR, dstG, dstB, width, height, outWidth, outHeight, srcStride, dstStride, stats)
+                            : d->netRemote->process(d->remoteConfig, srcR, srcG, srcB, dstR, dstG, dstB, width, height, outWidth, outHeight, srcStride, dstStride, stats) };
+        d->semaphore->release();
+
+        if (ret)
+            throw "the daemon failed to upscale the frame or has exited";
+        return false;
+    }
+#endif
+
+    if (!d->split) {
+        d->semaphore->acquire();
+        d->waifu2x->process(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride, stats, reuse);
+        d->semaphore->release();
+        return false;
+    }
+
+    auto onCPU{ d->split->acquire() };
+
+    // the split never gives the cpu more than one frame at a time
+    if (!onCPU)
+        d->semaphore->acquire();
+
+    auto start{ std::chrono::steady_clock::now() };
+    (onCPU ? d->waifu2xCPU : d->waifu2x)->process(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride, stats);
+    std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - start };
+
+    if (!onCPU)
+        d->semaphore->release();
+
+    d->split->release(onCPU, elapsed.count());
+    return onCPU;
+}
+
+static bool processFrame(const float* srcR, const float* srcG, const float* srcB, float* dstR, float* dstG, float* dstB,
+                         const int width, const int height, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                         const Waifu2xData* const VS_RESTRICT d, Waifu2xStats* stats, const Waifu2xReuse* reuse, int64_t activeArea[4]) {
+    if (!d->letterbox)
+        return upscale(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride, d, stats, reuse);
+
+    const auto scale{ d->scale };
+
+    int x0, y0, x1, y1;
+    detectActiveArea(srcR, srcG, srcB, width, height, srcStride, x0, y0, x1, y1);
+
+    activeArea[0] = x0;
+    activeArea[1] = y0;
+    activeArea[2] = x1 - x0;
+    activeArea[3] = y1 - y0;
+
+    if (x0 == x1) {
+        for (auto dst : { dstR, dstG, dstB })
+            fillBlack(dst, 0, d->vi.width, 0, d->vi.height, dstStride);
+        return false;
+    }
+
+    // the active area plus the context the model sees, aligned so that the network downsamples in the same phase as for the whole frame
+    const auto px0{ std::max(x0 - d->letterboxMargin, 0) & ~3 };
+    const auto py0{ std::max(y0 - d->letterboxMargin, 0) & ~3 };
+    const auto px1{ std::min(x1 + d->letterboxMargin, width) };
+    const auto py1{ std::min(y1 + d->letterboxMargin, height) };
+
+    // the anchor is cropped the same way, whatever its own borders are
+    Waifu2xReuse croppedReuse;
+    if (reuse) {
+        croppedReuse = *reuse;
+        croppedReuse.anchorR += py0 * srcStride + px0;
+        croppedReuse.anchorG += py0 * srcStride + px0;
+        croppedReuse.anchorB += py0 * srcStride + px0;
+        croppedReuse.x = px0;
+        croppedReuse.y = py0;
+    }
+
+    auto onCPU{ upscale(srcR + py0 * srcStride + px0, srcG + py0 * srcStride + px0, srcB + py0 * srcStride + px0,
+                        dstR + py0 * scale * dstStride + px0 * scale, dstG + py0 * scale * dstStride + px0 * scale, dstB + py0 * scale * dstStride + px0 * scale,
+                        px1 - px0, py1 - py0, srcStride, dstStride, d, stats, reuse ? &croppedReuse : nullptr) };
+
+    for (auto dst : { dstR, dstG, dstB }) {
+        fillBlack(dst, 0, d->vi.width, 0, y0 * scale, dstStride);
+        fillBlack(dst, 0, x0 * scale, y0 * scale, y1 * scale, dstStride);
+        fillBlack(dst, x1 * scale, d->vi.width, y0 * scale, y1 * scale, dstStride);
+        fillBlack(dst, 0, d->vi.width, y1 * scale, d->vi.height, dstStride);
+    }
+
+    return onCPU;
+}
+
+static void filter(const VSFrame* src, const VSFrame* anchor, VSFrame* dst, const int n, const Waifu2xData* const VS_RESTRICT d, const VSAPI* vsapi) {
     const auto width{ vsapi->getFrameWidth(src, 0) };
     const auto height{ vsapi->getFrameHeight(src, 0) };
     const auto srcStride{ vsapi->getStride(src, 0) / d->vi.format.bytesPerSample };
@@ -58,24 +301,133 @@ static void filter(const VSFrame* src, VSFrame* dst, const Waifu2xData* const VS
     auto dstG{ reinterpret_cast<float*>(vsapi->getWritePtr(dst, 1)) };
     auto dstB{ reinterpret_cast<float*>(vsapi->getWritePtr(dst, 2)) };
 
-    d->semaphore->acquire();
-    d->waifu2x->process(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride);
-    d->semaphore->release();
+    // tiles are reused from the first frame of the group only, a frame of another size is upscaled on its own
+    Waifu2xReuse reuse{};
+    auto reuseValid{ d->tileReuse && vsapi->getFrameWidth(anchor, 0) == width && vsapi->getFrameHeight(anchor, 0) == height &&
+                     vsapi->getStride(anchor, 0) / d->vi.format.bytesPerSample == srcStride };
+    if (reuseValid) {
+        reuse.frame = n;
+        reuse.anchor = n - n % d->tileReuseInterval;
+        reuse.anchorR = reinterpret_cast<const float*>(vsapi->getReadPtr(anchor, 0));
+        reuse.anchorG = reinterpret_cast<const float*>(vsapi->getReadPtr(anchor, 1));
+        reuse.anchorB = reinterpret_cast<const float*>(vsapi->getReadPtr(anchor, 2));
+    }
+
+    Waifu2xStats stats;
+    uint64_t key{};
+    auto cached{ false };
+    auto diskCached{ false };
+
+    if (d->cache || d->diskCache)
+        key = hash_planes(srcR, srcG, srcB, width, height, srcStride);
+
+    if (d->cache)
+        cached = d->cache->get(key, dstR, dstG, dstB, d->vi.width, d->vi.height, dstStride);
+
+    if (!cached && d->diskCache) {
+        diskCached = d->diskCache->get(key, dstR, dstG, dstB, d->vi.width, d->vi.height, dstStride);
+
+        if (diskCached && d->cache)
+            d->cache->put(key, dstR, dstG, dstB, d->vi.width, d->vi.height, dstStride);
+    }
+
+    int64_t activeArea[4]{ 0, 0, width, height };
+    auto throughput{ 0.0 };
+    auto onCPU{ false };
+
+    if (!cached && !diskCached) {
+        auto start{ std::chrono::steady_clock::now() };
+
+        onCPU = processFrame(srcR, srcG, srcB, dstR, dstG, dstB, width, height, srcStride, dstStride, d, &stats, reuseValid ? &reuse : nullptr, activeArea);
+
+        if (d->cache)
+            d->cache->put(key, dstR, dstG, dstB, d->vi.width, d->vi.height, dstStride);
+
+        if (d->diskCache)
+            d->diskCache->put(key, dstR, dstG, dstB, d->vi.width, d->vi.height, dstStride);
+
+        // output megapixels per second per thread, comparable across nodes with different core counts
+        if (d->cpu) {
+            std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - start };
+            throughput = d->vi.width * d->vi.height / elapsed.count() / d->numThreads / 1e6;
+        }
+    }
+
+    auto props{ vsapi->getFramePropertiesRW(dst) };
+
+    if (d->cache) {
+        vsapi->mapSetInt(props, "Waifu2xCacheHit", cached, maReplace);
+        vsapi->mapSetInt(props, "Waifu2xCacheHits", d->cache->hits(), maReplace);
+        vsapi->mapSetInt(props, "Waifu2xCacheMisses", d->cache->misses(), maReplace);
+    }
+
+    if (d->diskCache)
+        vsapi->mapSetInt(props, "Waifu2xDiskCacheHit", diskCached, maReplace);
+
+    if (d->cpu && !cached && !diskCached)
+        vsapi->mapSetFloat(props, "Waifu2xCPUThroughput", throughput, maReplace);
+
+    if (d->gpuInstance) {
+        vsapi->mapSetData(props, "Waifu2xUploadMemory", d->uploadMemory.c_str(), -1, dtUtf8, maReplace);
+        vsapi->mapSetData(props, "Waifu2xDownloadMemory", d->downloadMemory.c_str(), -1, dtUtf8, maReplace);
+    }
+
+    if (d->split) {
+        vsapi->mapSetInt(props, "Waifu2xOnCPU", onCPU, maReplace);
+        vsapi->mapSetFloat(props, "Waifu2xCPUShare", d->split->cpuShare(), maReplace);
+    }
+
+    if (d->letterbox && !cached && !diskCached)
+        vsapi->mapSetIntArray(props, "Waifu2xActiveArea", activeArea, 4);
+
+    if (d->ttaThreshold > 0.0f)
+        vsapi->mapSetInt(props, "Waifu2xTTAEscalated", stats.tta_escalated, maReplace);
+
+    if (d->tileReuse || d->flatSkip || d->hybrid)
+        vsapi->mapSetInt(props, "Waifu2xTiles", stats.tiles, maReplace);
+
+    if (d->tileReuse)
+        vsapi->mapSetInt(props, "Waifu2xTilesReused", stats.tiles_reused, maReplace);
+
+    if (d->flatSkip) {
+        vsapi->mapSetInt(props, "Waifu2xTilesFlat", stats.tiles_flat, maReplace);
+        vsapi->mapSetFloat(props, "Waifu2xFlatRatio", stats.tiles ? static_cast<double>(stats.tiles_flat) / stats.tiles : 0.0, maReplace);
+    }
+
+    if (d->hybrid) {
+        vsapi->mapSetInt(props, "Waifu2xTilesFast", stats.tiles_fast, maReplace);
+        vsapi->mapSetFloat(props, "Waifu2xFastRatio", stats.tiles ? static_cast<double>(stats.tiles_fast) / stats.tiles : 0.0, maReplace);
+    }
 }
 
 static const VSFrame* VS_CC waifu2xGetFrame(int n, int activationReason, void* instanceData, [[maybe_unused]] void** frameData,
                                             VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi) {
     auto d{ static_cast<const Waifu2xData*>(instanceData) };
 
+    // with tile reuse a frame is compared with the first frame of its group
+    const auto anchorN{ d->tileReuse ? n - n % d->tileReuseInterval : n };
+
     if (activationReason == arInitial) {
+        if (anchorN != n)
+            vsapi->requestFrameFilter(anchorN, d->node, frameCtx);
         vsapi->requestFrameFilter(n, d->node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
         auto src{ vsapi->getFrameFilter(n, d->node, frameCtx) };
+        auto anchor{ vsapi->getFrameFilter(anchorN, d->node, frameCtx) };
         auto dst{ vsapi->newVideoFrame(&d->vi.format, d->vi.width, d->vi.height, src, core) };
 
-        filter(src, dst, d, vsapi);
+        try {
+            filter(src, anchor, dst, n, d, vsapi);
+        } catch (const char* error) {
+            vsapi->setFilterError(("waifu2x-ncnn-Vulkan: "s + error).c_str(), frameCtx);
+            vsapi->freeFrame(src);
+            vsapi->freeFrame(anchor);
+            vsapi->freeFrame(dst);
+            return nullptr;
+        }
 
         vsapi->freeFrame(src);
+        vsapi->freeFrame(anchor);
         return dst;
     }
 
@@ -84,10 +436,11 @@ static const VSFrame* VS_CC waifu2xGetFrame(int n, int activationReason, void* i
 
 static void VS_CC waifu2xFree(void* instanceData, [[maybe_unused]] VSCore* core, const VSAPI* vsapi) {
     auto d{ static_cast<Waifu2xData*>(instanceData) };
+    auto gpuInstance{ d->gpuInstance };
     vsapi->freeNode(d->node);
     delete d;
 
-    if (--numGPUInstances == 0)
+    if (gpuInstance && --numGPUInstances == 0)
         ncnn::destroy_gpu_instance();
 }
 
@@ -105,9 +458,31 @@ static void VS_CC waifu2xCreate(const VSMap* in, VSMap* out, [[maybe_unused]] vo
             d->vi.format.bitsPerSample != 32)
             throw "only constant RGB format 32 bit float input supported";
 
-        if (ncnn::create_gpu_instance())
-            throw "failed to create GPU instance";
-        ++numGPUInstances;
+        // gpu_id=-1 runs on the cpu without creating a vulkan instance
+        auto gpuIdArg{ vsapi->mapGetIntSaturated(in, "gpu_id", 0, &err) };
+        d->cpu = !err && gpuIdArg == -1;
+
+        // with server the daemon owns the gpu and this process never touches vulkan
+        std::string server;
+        if (auto name{ vsapi->mapGetData(in, "server", 0, &err) }; !err)
+            server = name;
+
+        // same over tcp, for a daemon on another machine
+        std::string remote;
+        if (auto address{ vsapi->mapGetData(in, "remote", 0, &err) }; !err)
+            remote = address;
+
+        auto remoteEncoding{ vsapi->mapGetIntSaturated(in, "remote_encoding", 0, &err) };
+
+        auto daemon{ !server.empty() || !remote.empty() };
+
+        d->gpuInstance = !d->cpu && !daemon;
+
+        if (d->gpuInstance) {
+            if (ncnn::create_gpu_instance())
+                throw "failed to create GPU instance";
+            ++numGPUInstances;
+        }
 
         auto noise{ vsapi->mapGetIntSaturated(in, "noise", 0, &err) };
 
@@ -115,34 +490,115 @@ static void VS_CC waifu2xCreate(const VSMap* in, VSMap* out, [[maybe_unused]] vo
         if (err)
             scale = 2;
 
+        // on the cpu, smaller tiles keep the activations of each worker closer to its share of the cache and give every core a tile
+        constexpr auto cpuTileSize{ 128 };
+
         auto tile_w{ vsapi->mapGetIntSaturated(in, "tile_w", 0, &err) };
+        auto tileWSet{ !err };
         if (err)
-            tile_w = std::max(d->vi.width, 32);
+            tile_w = std::max(d->cpu ? std::min(d->vi.width, cpuTileSize) : d->vi.width, 32);
 
         auto tile_h{ vsapi->mapGetIntSaturated(in, "tile_h", 0, &err) };
+        auto tileHSet{ !err };
         if (err)
-            tile_h = std::max(d->vi.height, 32);
+            tile_h = std::max(d->cpu ? std::min(d->vi.height, cpuTileSize) : d->vi.height, 32);
+
+        auto width{ vsapi->mapGetIntSaturated(in, "width", 0, &err) };
+        if (err)
+            width = d->vi.width * scale;
+
+        auto height{ vsapi->mapGetIntSaturated(in, "height", 0, &err) };
+        if (err)
+            height = d->vi.height * scale;
 
         auto model{ vsapi->mapGetIntSaturated(in, "model", 0, &err) };
         if (err)
             model = 2;
 
+        // only asked when this process has a vulkan instance, ncnn would create one for the query otherwise
         auto gpuId{ vsapi->mapGetIntSaturated(in, "gpu_id", 0, &err) };
         if (err)
-            gpuId = ncnn::get_default_gpu_index();
+            gpuId = d->gpuInstance ? ncnn::get_default_gpu_index() : -1;
 
         auto gpuThread{ vsapi->mapGetIntSaturated(in, "gpu_thread", 0, &err) };
         if (err)
             gpuThread = 2;
 
-        auto tta{ !!vsapi->mapGetInt(in, "tta", 0, &err) };
+        auto numThreads{ vsapi->mapGetIntSaturated(in, "num_threads", 0, &err) };
+        if (err)
+            numThreads = ncnn::get_big_cpu_count();
+
+        auto cpuAssist{ !!vsapi->mapGetInt(in, "cpu_assist", 0, &err) };
+
+        auto tta{ vsapi->mapGetIntSaturated(in, "tta", 0, &err) };
+        auto ttaStream{ !!vsapi->mapGetInt(in, "tta_stream", 0, &err) };
+        auto ttaThreshold{ vsapi->mapGetFloatSaturated(in, "tta_threshold", 0, &err) };
         auto fp32{ !!vsapi->mapGetInt(in, "fp32", 0, &err) };
+        auto deterministic{ !!vsapi->mapGetInt(in, "deterministic", 0, &err) };
+        auto tileReuse{ !!vsapi->mapGetInt(in, "tile_reuse", 0, &err) };
+        auto tileReuseThreshold{ vsapi->mapGetFloatSaturated(in, "tile_reuse_threshold", 0, &err) };
+
+        auto tileReuseInterval{ vsapi->mapGetIntSaturated(in, "tile_reuse_interval", 0, &err) };
+        if (err)
+            tileReuseInterval = 24;
+        auto letterbox{ !!vsapi->mapGetInt(in, "letterbox", 0, &err) };
+        auto flatSkip{ !!vsapi->mapGetInt(in, "flat_skip", 0, &err) };
+        auto flatThreshold{ vsapi->mapGetFloatSaturated(in, "flat_threshold", 0, &err) };
+
+        auto hybridThreshold{ vsapi->mapGetFloatSaturated(in, "hybrid_threshold", 0, &err) };
+        if (err)
+            hybridThreshold = 0.02f;
+
+        auto cacheSize{ vsapi->mapGetIntSaturated(in, "cache_size", 0, &err) };
+
+        std::string cacheDir;
+        if (auto dir{ vsapi->mapGetData(in, "cache_dir", 0, &err) }; !err)
+            cacheDir = dir;
 
         if (noise < -1 || noise > 3)
             throw "noise must be between -1 and 3 (inclusive)";
 
-        if (scale < 1 || scale > 2)
-            throw "scale must be 1 or 2";
+        if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+            throw "scale must be 1, 2, 4 or 8";
+
+        if (tta != 0 && tta != 1 && tta != 2 && tta != 4 && tta != 8)
+            throw "tta must be 0, 1, 2, 4 or 8";
+
+        if (tta == 1)
+            tta = 8;
+
+        if (ttaThreshold < 0.0f)
+            throw "tta_threshold must be greater than or equal to 0.0";
+
+        if (ttaThreshold > 0.0f && tta < 4)
+            throw "tta_threshold requires tta=4 or tta=8";
+
+        if (width < 1)
+            throw "width must be greater than 0";
+
+        if (height < 1)
+            throw "height must be greater than 0";
+
+        if (tileReuseThreshold < 0.0f)
+            throw "tile_reuse_threshold must be greater than or equal to 0.0";
+
+        if (tileReuseInterval < 1)
+            throw "tile_reuse_interval must be greater than 0";
+
+        if (tileReuse && (scale > 2 || width != d->vi.width * scale || height != d->vi.height * scale))
+            throw "tile_reuse is not supported with scale=4, scale=8, width or height";
+
+        if (letterbox && (width != d->vi.width * scale || height != d->vi.height * scale))
+            throw "letterbox is not supported with width or height";
+
+        if (hybridThreshold < 0.0f)
+            throw "hybrid_threshold must be greater than or equal to 0.0";
+
+        if (flatThreshold < 0.0f)
+            throw "flat_threshold must be greater than or equal to 0.0";
+
+        if (cacheSize < 0)
+            throw "cache_size must be greater than or equal to 0";
 
         if (tile_w < 32)
             throw "tile_w must be at least 32";
@@ -150,17 +606,81 @@ static void VS_CC waifu2xCreate(const VSMap* in, VSMap* out, [[maybe_unused]] vo
         if (tile_h < 32)
             throw "tile_h must be at least 32";
 
-        if (model < 0 || model > 2)
-            throw "model must be between 0 and 2 (inclusive)";
+        if (model < 0 || model > 3)
+            throw "model must be between 0 and 3 (inclusive)";
 
         if (model != 2 && scale == 1)
             throw "only cunet model supports scale=1";
 
-        if (gpuId < 0 || gpuId >= ncnn::get_gpu_count())
-            throw "invalid GPU device";
+        if (d->cpu) {
+            if (cpuAssist)
+                throw "cpu_assist requires a GPU";
+
+            if (daemon)
+                throw "server and remote are not supported with gpu_id=-1";
 
-        if (auto queue_count{ ncnn::get_gpu_info(gpuId).compute_queue_count() }; gpuThread < 1 || static_cast<uint32_t>(gpuThread) > queue_count)
-            throw ("gpu_thread must be between 1 and " + std::to_string(queue_count) + " (inclusive)").c_str();
+            if (numThreads < 1)
+                throw "num_threads must be at least 1";
+
+            if (tileReuse || ttaThreshold > 0.0f)
+                throw "tile_reuse and tta_threshold are not supported with gpu_id=-1";
+
+            // tiles of a frame are spread over num_threads
+            gpuThread = 1;
+            d->numThreads = numThreads;
+        } else if (daemon) {
+#ifdef _WIN32
+            throw "server and remote are only supported on POSIX systems";
+#endif
+            if (!server.empty() && !remote.empty())
+                throw "server and remote cannot be used together";
+
+            if (server.find('/') != std::string::npos)
+                throw "server must not contain '/'";
+
+            if (remoteEncoding < 0 || remoteEncoding > 2)
+                throw "remote_encoding must be 0, 1 or 2";
+
+            if (cpuAssist || tileReuse)
+                throw "cpu_assist and tile_reuse are not supported with server and remote";
+
+            if (!!vsapi->mapGetInt(in, "list_gpu", 0, &err))
+                throw "list_gpu is not supported with server and remote";
+
+            // frames this node has in flight at the daemon
+            if (gpuThread < 1)
+                throw "gpu_thread must be at least 1";
+        } else {
+            if (gpuId < 0 || gpuId >= ncnn::get_gpu_count())
+                throw "invalid GPU device";
+
+            if (cpuAssist) {
+                if (numThreads < 1)
+                    throw "num_threads must be at least 1";
+
+                if (tileReuse || ttaThreshold > 0.0f)
+                    throw "tile_reuse and tta_threshold are not supported with cpu_assist";
+
+                d->numThreads = numThreads;
+            }
+
+            if (auto queue_count{ ncnn::get_gpu_info(gpuId).compute_queue_count() }; gpuThread < 1 || static_cast<uint32_t>(gpuThread) > queue_count)
+                throw ("gpu_thread must be between 1 and " + std::to_string(queue_count) + " (inclusive)").c_str();
+        }
+
+        if (deterministic) {
+            if (tileWSet || tileHSet)
+                throw "tile_w and tile_h are not supported with deterministic";
+
+            if (cpuAssist || tileReuse || ttaThreshold > 0.0f || model == 3)
+                throw "cpu_assist, tile_reuse, tta_threshold and model=3 are not supported with deterministic";
+
+            // one tile per pass, so the global pooling of the cunet SE blocks sees the whole frame rather than the tile around each pixel
+            // chained passes are tiled at their own input size, which is largest in the last pass
+            tile_w = std::max(d->vi.width * std::max(scale / 2, 1), 32);
+            tile_h = std::max(d->vi.height * std::max(scale / 2, 1), 32);
+            fp32 = true;
+        }
 
         if (!!vsapi->mapGetInt(in, "list_gpu", 0, &err)) {
             std::string text;
@@ -178,7 +698,7 @@ static void VS_CC waifu2xCreate(const VSMap* in, VSMap* out, [[maybe_unused]] vo
                 vsapi->freeMap(args);
                 vsapi->freeMap(ret);
 
-                if (--numGPUInstances == 0)
+                if (d->gpuInstance && --numGPUInstances == 0)
                     ncnn::destroy_gpu_instance();
 
                 return;
@@ -188,26 +708,34 @@ static void VS_CC waifu2xCreate(const VSMap* in, VSMap* out, [[maybe_unused]] vo
             vsapi->freeMap(args);
             vsapi->freeMap(ret);
 
-            if (--numGPUInstances == 0)
+            if (d->gpuInstance && --numGPUInstances == 0)
                 ncnn::destroy_gpu_instance();
 
             return;
         }
 
+        // resample on the gpu if the target size differs from the upscaled size
+        auto resize{ width != d->vi.width * scale || height != d->vi.height * scale };
+
+        // no network runs in that case, so there is nothing to resample with either
+        if (noise == -1 && scale == 1 && resize)
+            throw "width and height are not supported with noise=-1 and scale=1";
+
         if (noise == -1 && scale == 1) {
             vsapi->mapConsumeNode(out, "clip", d->node, maReplace);
 
-            if (--numGPUInstances == 0)
+            if (d->gpuInstance && --numGPUInstances == 0)
                 ncnn::destroy_gpu_instance();
 
             return;
         }
 
-        d->vi.width *= scale;
-        d->vi.height *= scale;
+        d->vi.width = width;
+        d->vi.height = height;
 
         std::string pluginPath{ vsapi->getPluginPath(vsapi->getPluginByID("com.holywu.waifu2x-ncnn-Vulkan", core)) };
-        auto modelDir{ pluginPath.substr(0, pluginPath.rfind('/')) + "/models" };
+        auto modelsDir{ pluginPath.substr(0, pluginPath.rfind('/')) + "/models" };
+        auto modelDir{ modelsDir };
 
         int prepadding{};
 
@@ -221,61 +749,164 @@ static void VS_CC waifu2xCreate(const VSMap* in, VSMap* out, [[maybe_unused]] vo
             prepadding = 7;
             break;
         case 2:
+        case 3:
             modelDir += "/models-cunet";
-            prepadding = (noise == -1 || scale == 2) ? 18 : 28;
+            prepadding = (noise == -1 || scale > 1) ? 18 : 28;
             break;
         }
 
-        std::string paramPath, modelPath;
+        auto modelName{ noise == -1 ? "scale2.0x_model"s : scale == 1 ? "noise" + std::to_string(noise) + "_model" : "noise" + std::to_string(noise) + "_scale2.0x_model" };
+        auto paramPath{ modelDir + "/" + modelName + ".param" };
+        auto modelPath{ modelDir + "/" + modelName + ".bin" };
 
-        if (noise == -1) {
-            paramPath = modelDir + "/scale2.0x_model.param";
-            modelPath = modelDir + "/scale2.0x_model.bin";
-        } else if (scale == 1) {
-            paramPath = modelDir + "/noise" + std::to_string(noise) + "_model.param";
-            modelPath = modelDir + "/noise" + std::to_string(noise) + "_model.bin";
-        } else {
-            paramPath = modelDir + "/noise" + std::to_string(noise) + "_scale2.0x_model.param";
-            modelPath = modelDir + "/noise" + std::to_string(noise) + "_scale2.0x_model.bin";
-        }
+        // hybrid routes smooth tiles to upconv_7_anime_style_art_rgb
+        auto fastParamPath{ modelsDir + "/models-upconv_7_anime_style_art_rgb/" + modelName + ".param" };
+        auto fastModelPath{ modelsDir + "/models-upconv_7_anime_style_art_rgb/" + modelName + ".bin" };
 
         std::ifstream ifs{ paramPath };
-        if (!ifs.is_open())
+        if (!ifs.is_open() && !daemon)
             throw "failed to load model";
         ifs.close();
 
-        d->waifu2x = std::make_unique<Waifu2x>(gpuId, tta, 1);
+        if (model == 3 && !daemon) {
+            ifs.open(fastParamPath);
+            if (!ifs.is_open())
+                throw "failed to load model";
+            ifs.close();
+        }
+
+        // the cpu engine of cpu_assist gets the same settings, so both produce the same output within float rounding,
+        // only the tiles of the upconv_7 models may be smaller since they do not change their output
+        auto createWaifu2x{ [&](const int gpu, const int threads, const int tileW, const int tileH) {
+            auto waifu2x{ std::make_unique<Waifu2x>(gpu, tta, threads, ttaStream || ttaThreshold > 0.0f) };
+
+            waifu2x->noise = noise;
+            waifu2x->scale = scale;
+            waifu2x->tile_w = tileW;
+            waifu2x->tile_h = tileH;
+            waifu2x->prepadding = prepadding;
+            waifu2x->tta_threshold = ttaThreshold;
+            waifu2x->target_width = resize ? width : 0;
+            waifu2x->target_height = resize ? height : 0;
+            waifu2x->tile_reuse = tileReuse;
+            waifu2x->tile_reuse_threshold = tileReuseThreshold;
+            waifu2x->flat_skip = flatSkip;
+            waifu2x->flat_threshold = flatThreshold;
+            waifu2x->hybrid = model == 3;
+            waifu2x->hybrid_threshold = hybridThreshold;
+            waifu2x->prepadding_fast = 7;
+            waifu2x->deterministic = deterministic;
 
 #ifdef _WIN32
-        auto paramBufferSize{ MultiByteToWideChar(CP_UTF8, 0, paramPath.c_str(), -1, nullptr, 0) };
-        auto modelBufferSize{ MultiByteToWideChar(CP_UTF8, 0, modelPath.c_str(), -1, nullptr, 0) };
-        std::vector<wchar_t> wparamPath(paramBufferSize);
-        std::vector<wchar_t> wmodelPath(modelBufferSize);
-        MultiByteToWideChar(CP_UTF8, 0, paramPath.c_str(), -1, wparamPath.data(), paramBufferSize);
-        MultiByteToWideChar(CP_UTF8, 0, modelPath.c_str(), -1, wmodelPath.data(), modelBufferSize);
-        d->waifu2x->load(wparamPath.data(), wmodelPath.data(), fp32);
+            auto paramBufferSize{ MultiByteToWideChar(CP_UTF8, 0, paramPath.c_str(), -1, nullptr, 0) };
+            auto modelBufferSize{ MultiByteToWideChar(CP_UTF8, 0, modelPath.c_str(), -1, nullptr, 0) };
+            std::vector<wchar_t> wparamPath(paramBufferSize);
+            std::vector<wchar_t> wmodelPath(modelBufferSize);
+            MultiByteToWideChar(CP_UTF8, 0, paramPath.c_str(), -1, wparamPath.data(), paramBufferSize);
+            MultiByteToWideChar(CP_UTF8, 0, modelPath.c_str(), -1, wmodelPath.data(), modelBufferSize);
+            waifu2x->load(wparamPath.data(), wmodelPath.data(), fp32);
+
+            if (model == 3) {
+                auto fastParamBufferSize{ MultiByteToWideChar(CP_UTF8, 0, fastParamPath.c_str(), -1, nullptr, 0) };
+                auto fastModelBufferSize{ MultiByteToWideChar(CP_UTF8, 0, fastModelPath.c_str(), -1, nullptr, 0) };
+                std::vector<wchar_t> wfastParamPath(fastParamBufferSize);
+                std::vector<wchar_t> wfastModelPath(fastModelBufferSize);
+                MultiByteToWideChar(CP_UTF8, 0, fastParamPath.c_str(), -1, wfastParamPath.data(), fastParamBufferSize);
+                MultiByteToWideChar(CP_UTF8, 0, fastModelPath.c_str(), -1, wfastModelPath.data(), fastModelBufferSize);
+                waifu2x->load_fast(wfastParamPath.data(), wfastModelPath.data());
+            }
 #else
-        d->waifu2x->load(paramPath, modelPath, fp32);
+            waifu2x->load(paramPath, modelPath, fp32);
+
+            if (model == 3)
+                waifu2x->load_fast(fastParamPath, fastModelPath);
 #endif
 
-        d->waifu2x->noise = noise;
-        d->waifu2x->scale = scale;
-        d->waifu2x->tile_w = tile_w;
-        d->waifu2x->tile_h = tile_h;
-        d->waifu2x->prepadding = prepadding;
+            return waifu2x;
+        } };
+
+        d->scale = scale;
+        d->ttaThreshold = ttaThreshold;
+        d->tileReuse = tileReuse;
+        d->tileReuseInterval = tileReuseInterval;
+        d->flatSkip = flatSkip;
+        d->hybrid = model == 3;
+
+#ifndef _WIN32
+        if (!server.empty()) {
+            d->remote = std::make_unique<shmipc::Client>();
+            if (d->remote->connect(server))
+                throw "no daemon is serving server, start w2xncnnvk-daemon with -n set to the same name first";
+        }
+
+        if (!remote.empty()) {
+            d->netRemote = std::make_unique<netipc::Client>();
+            if (d->netRemote->connect(remote, remoteEncoding))
+                throw "failed to connect to remote, it must be host:port of a w2xncnnvk-daemon started with -p";
+        }
+
+        if (daemon) {
+            // the daemon picks the tile size unless it was given or deterministic fixed it
+            d->remoteConfig = { model, noise, scale, tileWSet || deterministic ? tile_w : 0, tileHSet || deterministic ? tile_h : 0, resize ? width : 0, resize ? height : 0,
+                                tta, ttaStream, fp32, flatSkip, deterministic, ttaThreshold, flatThreshold, hybridThreshold };
+        }
+#endif
+
+        if (!daemon)
+            d->waifu2x = createWaifu2x(gpuId, d->cpu ? numThreads : 1, tile_w, tile_h);
+
+        // fail here rather than with an out of memory error on the first frame
+        if (deterministic && !daemon && !d->cpu && d->waifu2x->tile_memory() > d->waifu2x->device_memory())
+            throw "deterministic runs every pass as one tile, which needs more GPU memory than gpu_id has at this clip size and scale";
+
+        if (d->gpuInstance) {
+            d->uploadMemory = describeMemoryType(gpuId, d->waifu2x->upload_memory_type());
+            d->downloadMemory = describeMemoryType(gpuId, d->waifu2x->download_memory_type());
+        }
+
+        if (cpuAssist) {
+            // cunet pools over each tile, so its cpu engine has to cut the frame into the same tiles as the gpu
+            auto sameTiles{ model == 2 || model == 3 };
+            d->waifu2xCPU = createWaifu2x(-1, numThreads, sameTiles ? tile_w : std::min(tile_w, cpuTileSize), sameTiles ? tile_h : std::min(tile_h, cpuTileSize));
+            d->split = std::make_unique<WorkSplit>(gpuThread);
+        }
+
+        // chained passes see prepadding pixels of their own input, which is half as much of the source per pass
+        d->letterbox = letterbox;
+        d->letterboxMargin = 0;
+        for (auto passScale{ 1 }; passScale <= std::max(scale / 2, 1); passScale *= 2)
+            d->letterboxMargin += (prepadding + passScale - 1) / passScale;
 
         d->semaphore = std::make_unique<std::counting_semaphore<>>(gpuThread);
+
+        if (cacheSize > 0)
+            d->cache = std::make_unique<FrameCache>(static_cast<size_t>(cacheSize) << 20);
+
+        if (!cacheDir.empty()) {
+            // everything that changes the output goes into the key, so one directory can be shared by several setups
+            // the tiles change the output of cunet, 0x0 where the daemon picks them, and cpu and gpu differ within float rounding
+            auto keyTileW{ daemon && !tileWSet && !deterministic ? 0 : tile_w };
+            auto keyTileH{ daemon && !tileHSet && !deterministic ? 0 : tile_h };
+            auto device{ d->cpu ? "cpu"s : cpuAssist ? "gpu+cpu"s : "gpu"s };
+            auto settings{ modelPath + ";" + std::to_string(scale) + ";" + std::to_string(width) + "x" + std::to_string(height) + ";" +
+                           std::to_string(keyTileW) + "x" + std::to_string(keyTileH) + ";" + device + ";" +
+                           std::to_string(tta) + ";" + std::to_string(ttaThreshold) + ";" + std::to_string(fp32) + ";" +
+                           std::to_string(tileReuse ? tileReuseThreshold : -1.0f) + ";" + std::to_string(tileReuse ? tileReuseInterval : 0) + ";" + std::to_string(flatSkip ? flatThreshold : -1.0f) + ";" + std::to_string(letterbox) + ";" +
+                           std::to_string(model == 3 ? hybridThreshold : -1.0f) + ";" + std::to_string(deterministic) };
+            d->diskCache = std::make_unique<DiskCache>(cacheDir, hash_bytes(settings.data(), settings.size(), 0));
+        }
     } catch (const char* error) {
         vsapi->mapSetError(out, ("waifu2x-ncnn-Vulkan: "s + error).c_str());
         vsapi->freeNode(d->node);
 
-        if (--numGPUInstances == 0)
+        if (d->gpuInstance && --numGPUInstances == 0)
             ncnn::destroy_gpu_instance();
 
         return;
     }
 
-    VSFilterDependency deps[]{ {d->node, rpStrictSpatial} };
+    // tile reuse also requests the first frame of each group
+    VSFilterDependency deps[]{ {d->node, d->tileReuse ? rpGeneral : rpStrictSpatial} };
     vsapi->createVideoFilter(out, "waifu2x-ncnn-Vulkan", &d->vi, waifu2xGetFrame, waifu2xFree, fmParallel, deps, 1, d.get(), core);
     d.release();
 }
@@ -293,11 +924,30 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI
                              "scale:int:opt;"
                              "tile_w:int:opt;"
                              "tile_h:int:opt;"
+                             "width:int:opt;"
+                             "height:int:opt;"
                              "model:int:opt;"
+                             "hybrid_threshold:float:opt;"
                              "gpu_id:int:opt;"
                              "gpu_thread:int:opt;"
+                             "num_threads:int:opt;"
+                             "cpu_assist:int:opt;"
                              "tta:int:opt;"
+                             "tta_stream:int:opt;"
+                             "tta_threshold:float:opt;"
                              "fp32:int:opt;"
+                             "deterministic:int:opt;"
+                             "tile_reuse:int:opt;"
+                             "tile_reuse_threshold:float:opt;"
+                             "tile_reuse_interval:int:opt;"
+                             "letterbox:int:opt;"
+                             "flat_skip:int:opt;"
+                             "flat_threshold:float:opt;"
+                             "cache_size:int:opt;"
+                             "cache_dir:data:opt;"
+                             "server:data:opt;"
+                             "remote:data:opt;"
+                             "remote_encoding:int:opt;"
                              "list_gpu:int:opt;",
                              "clip:vnode;",
                              waifu2xCreate, nullptr, plugin);
@@ -0,0 +1,583 @@
+// frames handed between the plugin and w2xncnnvk-daemon through posix shared memory
+
+#include "shmipc.h"
+
+#if !_WIN32
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "planecopy.h"
+
+namespace shmipc {
+
+static const uint32_t shm_magic = 0x77327873;
+static const uint32_t shm_version = 3;
+
+// frames in flight over all clients, a power of two for the ring
+static const uint32_t slot_count = 64;
+
+// data segments are named per process, every client of the process counts on the same number
+static std::atomic<uint32_t> buffer_count(0);
+
+enum
+{
+    slot_free = 0,
+    slot_claimed,// a client is filling it in
+    slot_queued,
+    slot_done
+};
+
+struct Slot
+{
+    std::atomic<uint32_t> state;
+    // 0 while free and until the claiming client has stored its pid, cleared by whoever frees the slot
+    std::atomic<int32_t> client_pid;
+    sem_t done;
+    char data_name[64];
+    uint64_t data_size;
+    Waifu2xEngineConfig config;
+    int32_t w;
+    int32_t h;
+    int32_t out_w;
+    int32_t out_h;
+    int32_t status;
+    Waifu2xStats stats;
+};
+
+// bounded lock-free multi-producer multi-consumer queue of slot indices, after Dmitry Vyukov
+// there are as many cells as slots and a slot is queued at most once, so a push never finds the ring full
+struct Cell
+{
+    std::atomic<uint32_t> sequence;
+    uint32_t slot;
+};
+
+struct Header
+{
+    std::atomic<uint32_t> magic;// written last by the daemon
+    uint32_t version;
+    int32_t server_pid;
+    sem_t work;// one post per queued slot
+
+    alignas(64) std::atomic<uint32_t> enqueue_pos;
+    alignas(64) std::atomic<uint32_t> dequeue_pos;
+    alignas(64) Cell cells[slot_count];
+
+    Slot slots[slot_count];
+};
+
+// the segment is shared between processes, atomics must not fall back to locks
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "lock-free 32-bit atomics required");
+
+static void ring_push(Header* header, const uint32_t slot)
+{
+    uint32_t pos = header->enqueue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true)
+    {
+        cell = &header->cells[pos & (slot_count - 1)];
+        const int32_t diff = (int32_t)(cell->sequence.load(std::memory_order_acquire) - pos);
+        if (diff == 0 && header->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+
+        if (diff != 0)
+            pos = header->enqueue_pos.load(std::memory_order_relaxed);
+    }
+
+    cell->slot = slot;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+}
+
+// false if the cell at the head is still being written
+static bool ring_pop(Header* header, uint32_t& slot)
+{
+    uint32_t pos = header->dequeue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true)
+    {
+        cell = &header->cells[pos & (slot_count - 1)];
+        const int32_t diff = (int32_t)(cell->sequence.load(std::memory_order_acquire) - (pos + 1));
+        if (diff < 0)
+            return false;
+
+        if (diff == 0 && header->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+
+        if (diff > 0)
+            pos = header->dequeue_pos.load(std::memory_order_relaxed);
+    }
+
+    slot = cell->slot;
+    cell->sequence.store(pos + slot_count, std::memory_order_release);
+    return true;
+}
+
+static bool process_alive(const int pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static timespec deadline_after(const int timeout_ms)
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+// maps an existing segment, size 0 takes the size of the segment
+static Mapping* open_segment(const std::string& segment, size_t size)
+{
+    int fd = shm_open(segment.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size && (size_t)st.st_size < size) || (!size && st.st_size == 0))
+    {
+        close(fd);
+        return 0;
+    }
+
+    if (!size)
+        size = (size_t)st.st_size;
+
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return 0;
+
+    return new Mapping(data, size);
+}
+
+// creates a zero filled segment, fails if it already exists
+static Mapping* create_segment(const std::string& segment, const size_t size)
+{
+    int fd = shm_open(segment.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return 0;
+
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        shm_unlink(segment.c_str());
+        return 0;
+    }
+
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        shm_unlink(segment.c_str());
+        return 0;
+    }
+
+    return new Mapping(data, size);
+}
+
+std::string segment_name(const std::string& name)
+{
+    return "/w2xncnnvk-" + name;
+}
+
+Mapping::Mapping(void* _data, size_t _size) : data(_data), size(_size)
+{
+}
+
+Mapping::~Mapping()
+{
+    munmap(data, size);
+}
+
+Client::Client()
+{
+    header = 0;
+}
+
+Client::~Client()
+{
+    for (size_t i = 0; i < buffers.size(); i++)
+        shm_unlink(buffers[i]->name.c_str());
+}
+
+int Client::connect(const std::string& _name)
+{
+    name = _name;
+
+    control.reset(open_segment(segment_name(name), sizeof(Header)));
+    if (!control)
+        return -1;
+
+    header = (Header*)control->data;
+
+    if (header->magic.load(std::memory_order_acquire) != shm_magic || header->version != shm_version || !server_alive())
+    {
+        control.reset();
+        header = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+bool Client::server_alive() const
+{
+    return process_alive(header->server_pid);
+}
+
+Client::Buffer* Client::acquire_buffer(size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (size_t i = 0; i < idle.size(); i++)
+    {
+        if (idle[i]->mapping->size >= size)
+        {
+            Buffer* buffer = idle[i];
+            idle.erase(idle.begin() + i);
+            return buffer;
+        }
+    }
+
+    // frames grew, drop a buffer that is too small rather than keep one per size
+    if (!idle.empty())
+    {
+        Buffer* small = idle.back();
+        idle.pop_back();
+
+        shm_unlink(small->name.c_str());
+        for (size_t i = 0; i < buffers.size(); i++)
+        {
+            if (buffers[i].get() == small)
+            {
+                buffers.erase(buffers.begin() + i);
+                break;
+            }
+        }
+    }
+
+    std::unique_ptr<Buffer> buffer(new Buffer);
+    buffer->name = segment_name(name) + "-" + std::to_string(getpid()) + "-" + std::to_string(buffer_count.fetch_add(1, std::memory_order_relaxed));
+    buffer->mapping.reset(create_segment(buffer->name, size));
+    if (!buffer->mapping)
+        return 0;
+
+    buffers.push_back(std::move(buffer));
+    return buffers.back().get();
+}
+
+void Client::release_buffer(Buffer* buffer)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    idle.push_back(buffer);
+}
+
+int Client::claim_slot()
+{
+    while (true)
+    {
+        for (uint32_t i = 0; i < slot_count; i++)
+        {
+            uint32_t expected = slot_free;
+            if (header->slots[i].state.compare_exchange_strong(expected, slot_claimed, std::memory_order_acquire))
+            {
+                header->slots[i].client_pid.store(getpid(), std::memory_order_release);
+                return (int)i;
+            }
+        }
+
+        // every slot is in flight, wait for one of them
+        if (!server_alive())
+            return -1;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+int Client::process(const Waifu2xEngineConfig& config,
+                    const float* srcR, const float* srcG, const float* srcB,
+                    float* dstR, float* dstG, float* dstB,
+                    const int w, const int h, const int out_w, const int out_h,
+                    const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                    Waifu2xStats* stats)
+{
+    const size_t in_plane = (size_t)w * h;
+    const size_t out_plane = (size_t)out_w * out_h;
+    const size_t size = (in_plane + out_plane) * 3 * sizeof(float);
+
+    Buffer* buffer = acquire_buffer(size);
+    if (!buffer)
+        return -1;
+
+    float* in = (float*)buffer->mapping->data;
+    float* out = in + in_plane * 3;
+
+    copy_plane(srcR, srcStride, in, w, w, h);
+    copy_plane(srcG, srcStride, in + in_plane, w, w, h);
+    copy_plane(srcB, srcStride, in + in_plane * 2, w, w, h);
+
+    const int slot_index = claim_slot();
+    if (slot_index < 0)
+    {
+        release_buffer(buffer);
+        return -1;
+    }
+
+    Slot& slot = header->slots[slot_index];
+
+    // a post left over from a client that exited before waiting for it
+    while (sem_trywait(&slot.done) == 0)
+    {
+    }
+
+    strncpy(slot.data_name, buffer->name.c_str(), sizeof(slot.data_name) - 1);
+    slot.data_name[sizeof(slot.data_name) - 1] = '\0';
+    slot.data_size = buffer->mapping->size;
+    slot.config = config;
+    slot.w = w;
+    slot.h = h;
+    slot.out_w = out_w;
+    slot.out_h = out_h;
+    slot.status = -1;
+    slot.state.store(slot_queued, std::memory_order_release);
+
+    ring_push(header, (uint32_t)slot_index);
+    sem_post(&header->work);
+
+    while (true)
+    {
+        timespec deadline = deadline_after(1000);
+        if (sem_timedwait(&slot.done, &deadline) == 0)
+            break;
+
+        // the slot is lost with the daemon
+        if (errno == ETIMEDOUT && !server_alive())
+        {
+            release_buffer(buffer);
+            return -1;
+        }
+    }
+
+    slot.state.load(std::memory_order_acquire);
+
+    const int status = slot.status;
+    if (stats)
+        *stats = slot.stats;
+
+    slot.client_pid.store(0, std::memory_order_relaxed);
+    slot.state.store(slot_free, std::memory_order_release);
+
+    if (status == 0)
+    {
+        copy_plane(out, out_w, dstR, dstStride, out_w, out_h, true);
+        copy_plane(out + out_plane, out_w, dstG, dstStride, out_w, out_h, true);
+        copy_plane(out + out_plane * 2, out_w, dstB, dstStride, out_w, out_h, true);
+    }
+
+    release_buffer(buffer);
+
+    return status;
+}
+
+Server::Server()
+{
+    header = 0;
+}
+
+Server::~Server()
+{
+    if (header)
+        shm_unlink(segment_name(name).c_str());
+}
+
+int Server::create(const std::string& _name)
+{
+    name = _name;
+
+    const std::string segment = segment_name(name);
+
+    control.reset(create_segment(segment, sizeof(Header)));
+    if (!control)
+    {
+        // left behind by a daemon that did not exit cleanly
+        std::unique_ptr<Mapping> existing(open_segment(segment, sizeof(Header)));
+        if (existing)
+        {
+            Header* other = (Header*)existing->data;
+            if (other->magic.load(std::memory_order_acquire) == shm_magic && process_alive(other->server_pid))
+                return -1;
+        }
+
+        shm_unlink(segment.c_str());
+
+        control.reset(create_segment(segment, sizeof(Header)));
+        if (!control)
+            return -1;
+    }
+
+    header = (Header*)control->data;
+
+    header->version = shm_version;
+    header->server_pid = getpid();
+    sem_init(&header->work, 1, 0);
+
+    for (uint32_t i = 0; i < slot_count; i++)
+    {
+        header->cells[i].sequence.store(i, std::memory_order_relaxed);
+        sem_init(&header->slots[i].done, 1, 0);
+    }
+
+    header->magic.store(shm_magic, std::memory_order_release);
+
+    return 0;
+}
+
+bool Server::wait_request(Request& request, int timeout_ms)
+{
+    timespec deadline = deadline_after(timeout_ms);
+    while (sem_timedwait(&header->work, &deadline) != 0)
+    {
+        if (errno != EINTR)
+            return false;
+    }
+
+    // the post comes after the push, but a push ahead of it in the ring may still be completing
+    uint32_t slot_index;
+    while (!ring_pop(header, slot_index))
+        std::this_thread::yield();
+
+    Slot& slot = header->slots[slot_index];
+    slot.state.load(std::memory_order_acquire);
+
+    request.slot = (int)slot_index;
+    request.config = slot.config;
+    request.w = slot.w;
+    request.h = slot.h;
+    request.out_w = slot.out_w;
+    request.out_h = slot.out_h;
+    request.data.reset();
+
+    const size_t size = ((size_t)slot.w * slot.h + (size_t)slot.out_w * slot.out_h) * 3 * sizeof(float);
+
+    char data_name[sizeof(slot.data_name)];
+    memcpy(data_name, slot.data_name, sizeof(data_name));
+    data_name[sizeof(data_name) - 1] = '\0';
+
+    if (slot.w > 0 && slot.h > 0 && slot.out_w > 0 && slot.out_h > 0 && size <= slot.data_size)
+        request.data = map_data(data_name, slot.data_size, slot.client_pid.load(std::memory_order_acquire));
+
+    if (!request.data)
+    {
+        finish(request, -1, Waifu2xStats());
+        return false;
+    }
+
+    return true;
+}
+
+void Server::finish(const Request& request, int status, const Waifu2xStats& stats)
+{
+    Slot& slot = header->slots[request.slot];
+
+    slot.status = status;
+    slot.stats = stats;
+
+    if (!process_alive(slot.client_pid.load(std::memory_order_acquire)))
+    {
+        slot.client_pid.store(0, std::memory_order_relaxed);
+        slot.state.store(slot_free, std::memory_order_release);
+        return;
+    }
+
+    slot.state.store(slot_done, std::memory_order_release);
+    sem_post(&slot.done);
+}
+
+void Server::sweep()
+{
+    for (uint32_t i = 0; i < slot_count; i++)
+    {
+        Slot& slot = header->slots[i];
+
+        // a pid of 0 is a slot just claimed by a client that has not stored its pid yet,
+        // a freed slot always has it cleared, so a pid that is set belongs to the current claim
+        uint32_t state = slot.state.load(std::memory_order_acquire);
+        const int32_t pid = slot.client_pid.load(std::memory_order_acquire);
+        if ((state == slot_claimed || state == slot_done) && pid != 0 && !process_alive(pid))
+        {
+            // a client claiming the slot right after it is freed may store its pid first
+            int32_t expected = pid;
+            if (slot.state.compare_exchange_strong(state, slot_free, std::memory_order_release))
+                slot.client_pid.compare_exchange_strong(expected, 0, std::memory_order_relaxed);
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (size_t i = 0; i < data_mappings.size();)
+    {
+        if (process_alive(data_mappings[i].second.pid))
+        {
+            i++;
+            continue;
+        }
+
+        shm_unlink(data_mappings[i].first.c_str());
+        data_mappings.erase(data_mappings.begin() + i);
+    }
+}
+
+std::shared_ptr<Mapping> Server::map_data(const std::string& data_name, size_t size, int pid)
+{
+    // only segments of this daemon's clients
+    const std::string prefix = segment_name(name) + "-";
+    if (data_name.compare(0, prefix.size(), prefix) != 0 || data_name.find('/', 1) != std::string::npos)
+        return std::shared_ptr<Mapping>();
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (size_t i = 0; i < data_mappings.size(); i++)
+    {
+        if (data_mappings[i].first != data_name)
+            continue;
+
+        if (data_mappings[i].second.mapping->size == size)
+            return data_mappings[i].second.mapping;
+
+        data_mappings.erase(data_mappings.begin() + i);
+        break;
+    }
+
+    std::shared_ptr<Mapping> mapping(open_segment(data_name, size));
+    if (!mapping)
+        return mapping;
+
+    DataMapping entry;
+    entry.pid = pid;
+    entry.mapping = mapping;
+    data_mappings.push_back(std::make_pair(data_name, entry));
+
+    return mapping;
+}
+
+} // namespace shmipc
+#endif // !_WIN32
@@ -0,0 +1,150 @@
+// frames handed between the plugin and w2xncnnvk-daemon through posix shared memory
+
+#ifndef SHMIPC_H
+#define SHMIPC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "waifu2x.h"
+
+// settings that select an engine in the daemon, clients with equal settings share one
+// all fields are 4 bytes so that the struct has no padding and compares bytewise
+struct Waifu2xEngineConfig
+{
+    int32_t model;
+    int32_t noise;
+    int32_t scale;
+    int32_t tile_w;// 0 for the daemon default
+    int32_t tile_h;
+    int32_t target_width;// 0 unless resampled
+    int32_t target_height;
+    int32_t tta;
+    int32_t tta_stream;
+    int32_t fp32;
+    int32_t flat_skip;
+    int32_t deterministic;
+    float tta_threshold;
+    float flat_threshold;
+    float hybrid_threshold;
+};
+
+#if !_WIN32
+namespace shmipc {
+
+struct Header;
+struct Slot;
+
+// name of the control segment of a daemon, names must not contain '/'
+std::string segment_name(const std::string& name);
+
+// shared memory segment mapped read-write, unmapped on destruction
+class Mapping
+{
+public:
+    Mapping(void* data, size_t size);
+    ~Mapping();
+
+    void* data;
+    size_t size;
+};
+
+// attaches to a running daemon, thread safe
+class Client
+{
+public:
+    Client();
+    ~Client();
+
+    // 0 on success, -1 if no daemon serves name
+    int connect(const std::string& name);
+
+    // out_w x out_h is the size the daemon gives for the config and w x h, stats may be 0
+    // -1 if the daemon failed the frame or went away
+    int process(const Waifu2xEngineConfig& config,
+                const float* srcR, const float* srcG, const float* srcB,
+                float* dstR, float* dstG, float* dstB,
+                const int w, const int h, const int out_w, const int out_h,
+                const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                Waifu2xStats* stats);
+
+private:
+    // planes of one frame in flight, the input followed by the output
+    struct Buffer
+    {
+        std::string name;
+        std::unique_ptr<Mapping> mapping;
+    };
+
+    Buffer* acquire_buffer(size_t size);
+    void release_buffer(Buffer* buffer);
+
+    int claim_slot();
+    bool server_alive() const;
+
+private:
+    std::string name;
+    std::unique_ptr<Mapping> control;
+    Header* header;
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<Buffer> > buffers;
+    std::vector<Buffer*> idle;
+};
+
+// request as seen by the daemon
+struct Request
+{
+    int slot;
+    Waifu2xEngineConfig config;
+    int w;
+    int h;
+    int out_w;
+    int out_h;
+    std::shared_ptr<Mapping> data;// input planes then output planes, packed
+};
+
+// owns the control segment of a daemon, thread safe
+class Server
+{
+public:
+    Server();
+    ~Server();
+
+    // -1 if another live daemon already serves name
+    int create(const std::string& name);
+
+    // blocks for the next request up to timeout_ms, false on timeout or if the request was malformed
+    bool wait_request(Request& request, int timeout_ms);
+
+    // hands the result back to the client and frees the slot for reuse
+    void finish(const Request& request, int status, const Waifu2xStats& stats);
+
+    // frees slots and mappings left behind by clients that exited
+    void sweep();
+
+private:
+    std::shared_ptr<Mapping> map_data(const std::string& data_name, size_t size, int pid);
+
+private:
+    std::string name;
+    std::unique_ptr<Mapping> control;
+    Header* header;
+
+    std::mutex lock;
+    struct DataMapping
+    {
+        int pid;
+        std::shared_ptr<Mapping> mapping;
+    };
+    std::vector<std::pair<std::string, DataMapping> > data_mappings;
+};
+
+} // namespace shmipc
+#endif // !_WIN32
+
+#endif // SHMIPC_H
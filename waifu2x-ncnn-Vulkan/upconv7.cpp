@@ -0,0 +1,316 @@
+// fused cpu engine for the upconv_7 models
+
+#include "upconv7.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+
+// ncnn
+#include "cpu.h"
+
+// inlined into the row loop, the row kernels lose their register blocking
+#if defined(__GNUC__)
+#define UPCONV7_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define UPCONV7_NOINLINE __declspec(noinline)
+#else
+#define UPCONV7_NOINLINE
+#endif
+
+// the build baseline stays sse2, avx2 and avx512 copies of the whole engine are picked at runtime
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define UPCONV7_X86_DISPATCH 1
+#endif
+
+// channels of the activations, input first
+static const int upconv7_channels[Upconv7::layer_count + 1] = { 3, 16, 32, 64, 128, 128, 256, 3 };
+
+// 4x4 stride 2 deconvolution, 3 pixels cropped on each side
+static const int deconv_kernel = 4;
+static const int deconv_pad = 3;
+
+// outputs per input pixel of the deconvolution, outch x ky x kx
+static const int deconv_taps = 3 * deconv_kernel * deconv_kernel;
+
+static const float leaky_slope = 0.1f;
+
+#if _WIN32
+static FILE* open_file(const std::wstring& path)
+{
+    return _wfopen(path.c_str(), L"rb");
+}
+#else
+static FILE* open_file(const std::string& path)
+{
+    return fopen(path.c_str(), "rb");
+}
+#endif
+
+// layer type and key=value pairs of every layer in a text param file
+static int parse_param(FILE* fp, std::vector<std::pair<std::string, std::map<int, std::string> > >& layers)
+{
+    int magic = 0;
+    if (fscanf(fp, "%d", &magic) != 1 || magic != 7767517)
+        return -1;
+
+    int layer_count = 0;
+    int blob_count = 0;
+    if (fscanf(fp, "%d %d", &layer_count, &blob_count) != 2)
+        return -1;
+
+    for (int i = 0; i < layer_count; i++)
+    {
+        char type[256];
+        char name[256];
+        int bottom_count = 0;
+        int top_count = 0;
+        if (fscanf(fp, "%255s %255s %d %d", type, name, &bottom_count, &top_count) != 4)
+            return -1;
+
+        for (int j = 0; j < bottom_count + top_count; j++)
+        {
+            char blob[256];
+            if (fscanf(fp, "%255s", blob) != 1)
+                return -1;
+        }
+
+        std::map<int, std::string> params;
+
+        // the rest of the line
+        char line[1024];
+        if (!fgets(line, sizeof(line), fp))
+            line[0] = '\0';
+
+        char* saveptr = line;
+        while (true)
+        {
+            while (*saveptr == ' ' || *saveptr == '\t')
+                saveptr++;
+
+            if (*saveptr == '\0' || *saveptr == '\n' || *saveptr == '\r')
+                break;
+
+            char* end = saveptr;
+            while (*end != '\0' && *end != ' ' && *end != '\t' && *end != '\n' && *end != '\r')
+                end++;
+
+            std::string pair(saveptr, end);
+            size_t eq = pair.find('=');
+            if (eq == std::string::npos)
+                return -1;
+
+            params[atoi(pair.substr(0, eq).c_str())] = pair.substr(eq + 1);
+
+            saveptr = end;
+        }
+
+        layers.push_back(std::make_pair(std::string(type), params));
+    }
+
+    return 0;
+}
+
+static int param_int(const std::map<int, std::string>& params, int id, int default_value)
+{
+    std::map<int, std::string>::const_iterator it = params.find(id);
+    return it == params.end() ? default_value : atoi(it->second.c_str());
+}
+
+// one weight array as written by ncnn, fp32 or fp16 with its tag
+static int load_weight(FILE* fp, std::vector<float>& data, const size_t size)
+{
+    unsigned int tag;
+    if (fread(&tag, sizeof(tag), 1, fp) != 1)
+        return -1;
+
+    data.resize(size);
+
+    if (tag == 0x01306B47)
+    {
+        // fp16, padded to 4 bytes
+        std::vector<unsigned short> half((size + 1) / 2 * 2);
+        if (fread(half.data(), sizeof(unsigned short), half.size(), fp) != half.size())
+            return -1;
+
+        for (size_t i = 0; i < size; i++)
+            data[i] = ncnn::float16_to_float32(half[i]);
+
+        return 0;
+    }
+
+    if (tag == 0 || tag == 0x0002C056)
+    {
+        if (fread(data.data(), sizeof(float), size, fp) != size)
+            return -1;
+
+        return 0;
+    }
+
+    // quantized weights are not supported
+    return -1;
+}
+
+#if _WIN32
+int Upconv7::load(const std::wstring& parampath, const std::wstring& modelpath)
+#else
+int Upconv7::load(const std::string& parampath, const std::string& modelpath)
+#endif
+{
+    std::vector<std::pair<std::string, std::map<int, std::string> > > layers;
+    {
+        FILE* fp = open_file(parampath);
+        if (!fp)
+            return -1;
+
+        int ret = parse_param(fp, layers);
+
+        fclose(fp);
+
+        if (ret != 0)
+            return -1;
+    }
+
+    if ((int)layers.size() != layer_count + 1 || layers[0].first != "Input")
+        return -1;
+
+    for (int i = 0; i < layer_count; i++)
+    {
+        const std::map<int, std::string>& params = layers[i + 1].second;
+
+        const int inch = upconv7_channels[i];
+        const int outch = upconv7_channels[i + 1];
+
+        if (param_int(params, 0, 0) != outch || param_int(params, 5, 0) != 1)
+            return -1;
+
+        if (i < layer_count - 1)
+        {
+            // 3x3 valid convolution with leaky relu
+            if (layers[i + 1].first != "Convolution"
+                    || param_int(params, 1, 0) != 3 || param_int(params, 2, 1) != 1 || param_int(params, 3, 1) != 1
+                    || param_int(params, 4, 0) != 0 || param_int(params, 9, 0) != 2
+                    || param_int(params, 6, 0) != outch * inch * 9)
+                return -1;
+
+            std::map<int, std::string>::const_iterator slope = params.find(-23310);
+            if (slope == params.end() || std::abs(atof(slope->second.substr(slope->second.find(',') + 1).c_str()) - leaky_slope) > 1e-6)
+                return -1;
+        }
+        else
+        {
+            if (layers[i + 1].first != "Deconvolution"
+                    || param_int(params, 1, 0) != deconv_kernel || param_int(params, 2, 1) != 1 || param_int(params, 3, 1) != 2
+                    || param_int(params, 4, 0) != deconv_pad || param_int(params, 9, 0) != 0
+                    || param_int(params, 6, 0) != outch * inch * deconv_kernel * deconv_kernel)
+                return -1;
+        }
+    }
+
+    FILE* fp = open_file(modelpath);
+    if (!fp)
+        return -1;
+
+    for (int i = 0; i < layer_count; i++)
+    {
+        const int inch = upconv7_channels[i];
+        const int outch = upconv7_channels[i + 1];
+        const int maxk = i < layer_count - 1 ? 9 : deconv_kernel * deconv_kernel;
+
+        std::vector<float> weight;
+        if (load_weight(fp, weight, (size_t)outch * inch * maxk) != 0)
+        {
+            fclose(fp);
+            return -1;
+        }
+
+        biases[i].resize(outch);
+        if (fread(biases[i].data(), sizeof(float), outch, fp) != (size_t)outch)
+        {
+            fclose(fp);
+            return -1;
+        }
+
+        // ncnn stores [outch][inch][ky][kx] for both layer types
+        weights[i].resize(weight.size());
+        for (int p = 0; p < outch; p++)
+        {
+            for (int q = 0; q < inch; q++)
+            {
+                for (int k = 0; k < maxk; k++)
+                {
+                    const float v = weight[(p * inch + q) * maxk + k];
+
+                    if (i < layer_count - 1)
+                        weights[i][(k * inch + q) * outch + p] = v;
+                    else
+                        weights[i][(q * outch + p) * maxk + k] = v;
+                }
+            }
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+namespace upconv7_generic {
+#include "upconv7_kernels.h"
+} // namespace upconv7_generic
+
+#if UPCONV7_X86_DISPATCH
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace upconv7_avx2 {
+#include "upconv7_kernels.h"
+} // namespace upconv7_avx2
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f,fma")
+#endif
+namespace upconv7_avx512 {
+#include "upconv7_kernels.h"
+} // namespace upconv7_avx512
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif // UPCONV7_X86_DISPATCH
+
+typedef void (*upconv7_forward_func)(const std::vector<float>* weights, const std::vector<float>* biases, const ncnn::Mat& in, ncnn::Mat& out);
+
+static upconv7_forward_func select_forward()
+{
+#if UPCONV7_X86_DISPATCH
+    if (ncnn::cpu_support_x86_avx512())
+        return upconv7_avx512::forward;
+
+    if (ncnn::cpu_support_x86_avx2() && ncnn::cpu_support_x86_fma())
+        return upconv7_avx2::forward;
+#endif
+
+    return upconv7_generic::forward;
+}
+
+void Upconv7::forward(const ncnn::Mat& in, ncnn::Mat& out) const
+{
+    static const upconv7_forward_func forward_func = select_forward();
+
+    forward_func(weights, biases, in, out);
+}
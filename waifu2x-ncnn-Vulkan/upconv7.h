@@ -0,0 +1,37 @@
+// fused cpu engine for the upconv_7 models
+
+#ifndef UPCONV7_H
+#define UPCONV7_H
+
+#include <string>
+#include <vector>
+
+// ncnn
+#include "mat.h"
+
+// six 3x3 convolutions with leaky relu and a 4x4 stride 2 deconvolution, streamed row by row
+// through all layers so that only a few rows of each activation are alive at any time
+class Upconv7
+{
+public:
+    // fails unless the param file describes exactly the upconv_7 network
+#if _WIN32
+    int load(const std::wstring& parampath, const std::wstring& modelpath);
+#else
+    int load(const std::string& parampath, const std::string& modelpath);
+#endif
+
+    // same input and output as Input1 and Eltwise4 of the ncnn network, planar fp32
+    // the output is 2 * (w - 14) x 2 * (h - 14)
+    void forward(const ncnn::Mat& in, ncnn::Mat& out) const;
+
+public:
+    static const int layer_count = 7;
+
+private:
+    // weights repacked to [ky][kx][inch][outch], the deconvolution to [inch][outch][ky][kx]
+    std::vector<float> weights[layer_count];
+    std::vector<float> biases[layer_count];
+};
+
+#endif // UPCONV7_H
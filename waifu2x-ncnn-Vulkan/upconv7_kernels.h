@@ -0,0 +1,227 @@
+// kernels of the fused upconv_7 engine
+// no include guard, upconv7.cpp includes this once per instruction set inside its own namespace
+
+// XB output pixels x OB output channels, kept in registers across the whole reduction
+template<int IC, int OC, int XB>
+static inline void conv3x3_leaky_block(const float* const* rows, const int x, const float* weight, const float* bias, float* out)
+{
+    constexpr int OB = 16;
+
+    for (int ob = 0; ob < OC; ob += OB)
+    {
+        float sum[XB][OB];
+        for (int i = 0; i < XB; i++)
+        {
+            for (int o = 0; o < OB; o++)
+                sum[i][o] = bias[ob + o];
+        }
+
+        for (int k = 0; k < 9; k++)
+        {
+            const float* inptr = rows[k / 3] + (x + k % 3) * IC;
+            const float* kptr = weight + k * IC * OC + ob;
+
+            for (int q = 0; q < IC; q++)
+            {
+                for (int i = 0; i < XB; i++)
+                {
+                    const float v = inptr[i * IC + q];
+                    for (int o = 0; o < OB; o++)
+                        sum[i][o] += v * kptr[o];
+                }
+
+                kptr += OC;
+            }
+        }
+
+        for (int i = 0; i < XB; i++)
+        {
+            float* outptr = out + (x + i) * OC + ob;
+            for (int o = 0; o < OB; o++)
+                outptr[o] = sum[i][o] < 0.f ? sum[i][o] * leaky_slope : sum[i][o];
+        }
+    }
+}
+
+// one output row of a valid 3x3 convolution, rows are pixel major with the channels innermost
+template<int IC, int OC>
+UPCONV7_NOINLINE static void conv3x3_leaky_row(const float* const* rows, const int outw, const float* weight, const float* bias, float* out)
+{
+    constexpr int XB = 4;
+
+    int x = 0;
+    for (; x + XB <= outw; x += XB)
+        conv3x3_leaky_block<IC, OC, XB>(rows, x, weight, bias, out);
+    for (; x < outw; x++)
+        conv3x3_leaky_block<IC, OC, 1>(rows, x, weight, bias, out);
+}
+
+// all 48 deconvolution taps of one input pixel
+template<int IC>
+static inline void deconv_pixel(const float* inptr, const float* weight, float* taps)
+{
+    float sum[deconv_taps] = {};
+
+    for (int q = 0; q < IC; q++)
+    {
+        const float v = inptr[q];
+        const float* kptr = weight + q * deconv_taps;
+        for (int j = 0; j < deconv_taps; j++)
+            sum[j] += v * kptr[j];
+    }
+
+    std::memcpy(taps, sum, sizeof(sum));
+}
+
+namespace {
+
+// row buffers of one forward pass
+struct Upconv7Stream
+{
+    const ncnn::Mat* in;
+    const std::vector<float>* weights;
+    const std::vector<float>* biases;
+
+    // activation k is the input for k = 0 and the output of convolution k otherwise
+    int widths[Upconv7::layer_count];
+    int produced[Upconv7::layer_count];
+
+    // the last three rows of activations 0 to 5, a single row of activation 6
+    std::vector<float> rings[Upconv7::layer_count];
+
+    float* row(int k, int y)
+    {
+        const size_t row_size = (size_t)widths[k] * upconv7_channels[k];
+        return rings[k].data() + (k == Upconv7::layer_count - 1 ? 0 : (y % 3) * row_size);
+    }
+
+    // compute the next row of activation k, whose input rows must be there already
+    void produce_row(int k)
+    {
+        const int y = produced[k];
+
+        if (k == 0)
+        {
+            float* outptr = row(0, y);
+            for (int q = 0; q < 3; q++)
+            {
+                const float* ptr = in->channel(q).row(y);
+                for (int x = 0; x < widths[0]; x++)
+                    outptr[x * 3 + q] = ptr[x];
+            }
+        }
+        else
+        {
+            const float* rows[3] = { row(k - 1, y), row(k - 1, y + 1), row(k - 1, y + 2) };
+            const float* weight = weights[k - 1].data();
+            const float* bias = biases[k - 1].data();
+            float* outptr = row(k, y);
+
+            switch (k)
+            {
+            case 1: conv3x3_leaky_row<3, 16>(rows, widths[k], weight, bias, outptr); break;
+            case 2: conv3x3_leaky_row<16, 32>(rows, widths[k], weight, bias, outptr); break;
+            case 3: conv3x3_leaky_row<32, 64>(rows, widths[k], weight, bias, outptr); break;
+            case 4: conv3x3_leaky_row<64, 128>(rows, widths[k], weight, bias, outptr); break;
+            case 5: conv3x3_leaky_row<128, 128>(rows, widths[k], weight, bias, outptr); break;
+            case 6: conv3x3_leaky_row<128, 256>(rows, widths[k], weight, bias, outptr); break;
+            }
+        }
+
+        produced[k]++;
+    }
+
+    // compute the next row of activation k, pulling the rows it needs through the layers below
+    // a layer only advances while the one above lacks input, so no ring row is overwritten before it is consumed
+    void produce(int k)
+    {
+        const int target = produced[k] + 1;
+
+        while (produced[k] < target)
+        {
+            int l = k;
+            while (l > 0 && produced[l - 1] < produced[l] + 3)
+                l--;
+
+            produce_row(l);
+        }
+    }
+};
+
+} // namespace
+
+static void forward(const std::vector<float>* weights, const std::vector<float>* biases, const ncnn::Mat& in, ncnn::Mat& out)
+{
+    const int last = Upconv7::layer_count - 1;
+
+    Upconv7Stream stream;
+    stream.in = &in;
+    stream.weights = weights;
+    stream.biases = biases;
+
+    for (int k = 0; k < Upconv7::layer_count; k++)
+    {
+        stream.widths[k] = in.w - 2 * k;
+        stream.produced[k] = 0;
+        stream.rings[k].resize((size_t)(k == last ? 1 : 3) * stream.widths[k] * upconv7_channels[k]);
+    }
+
+    const int w6 = stream.widths[last];
+    const int h6 = in.h - 2 * last;
+
+    const int outw = 2 * w6 - 4;
+    const int outh = 2 * h6 - 4;
+
+    out.create(outw, outh, 3, (size_t)4u, 1);
+
+    // deconvolution output rows before cropping, four are alive at a time
+    const int accw = 2 * w6 + 2;
+    std::vector<float> acc((size_t)4 * 3 * accw, 0.f);
+    std::vector<float> taps(deconv_taps);
+
+    const float* deconv_weight = weights[last].data();
+    const float* deconv_bias = biases[last].data();
+
+    for (int i = 0; i < h6; i++)
+    {
+        stream.produce(last);
+
+        // scatter every input pixel into output rows 2i to 2i+3
+        const float* inptr = stream.row(last, i);
+        for (int x = 0; x < w6; x++)
+        {
+            deconv_pixel<256>(inptr + x * 256, deconv_weight, taps.data());
+
+            for (int p = 0; p < 3; p++)
+            {
+                for (int ky = 0; ky < deconv_kernel; ky++)
+                {
+                    float* accptr = acc.data() + ((size_t)((2 * i + ky) % 4) * 3 + p) * accw + 2 * x;
+                    const float* tptr = taps.data() + (p * deconv_kernel + ky) * deconv_kernel;
+                    for (int kx = 0; kx < deconv_kernel; kx++)
+                        accptr[kx] += tptr[kx];
+                }
+            }
+        }
+
+        // rows 2i and 2i+1 get nothing from later input rows
+        for (int r = 2 * i; r < 2 * i + 2; r++)
+        {
+            const int y = r - deconv_pad;
+
+            for (int p = 0; p < 3; p++)
+            {
+                float* accptr = acc.data() + ((size_t)(r % 4) * 3 + p) * accw;
+
+                if (y >= 0 && y < outh)
+                {
+                    float* outptr = out.channel(p).row(y);
+                    for (int x = 0; x < outw; x++)
+                        outptr[x] = accptr[x + deconv_pad] + deconv_bias[p];
+                }
+
+                std::fill(accptr, accptr + accw, 0.f);
+            }
+        }
+    }
+}
@@ -2,16 +2,323 @@
 
 #include "waifu2x.h"
 
+#include <cmath>
 #include <cstring>
 #include <algorithm>
+#include <memory>
 #include <vector>
 
+#include "cpu.h"
+
+#include "planecopy.h"
+
 #include "waifu2x_preproc.comp.hex.h"
 #include "waifu2x_postproc.comp.hex.h"
 #include "waifu2x_preproc_tta.comp.hex.h"
 #include "waifu2x_postproc_tta.comp.hex.h"
+#include "waifu2x_preproc_tta2.comp.hex.h"
+#include "waifu2x_postproc_tta2.comp.hex.h"
+#include "waifu2x_preproc_tta4.comp.hex.h"
+#include "waifu2x_postproc_tta4.comp.hex.h"
+#include "waifu2x_preproc_tta_stream.comp.hex.h"
+#include "waifu2x_postproc_tta_stream.comp.hex.h"
+#include "waifu2x_tta_diff.comp.hex.h"
+#include "waifu2x_tile_copy.comp.hex.h"
+#include "waifu2x_tile_stats.comp.hex.h"
+#include "waifu2x_tile_fill.comp.hex.h"
+
+// whether the region x0, y0 to x1, y1 of planes a is within threshold of the same region of planes b
+static bool tile_input_matches(const float* const a[3], const float* const b[3], const ptrdiff_t stride,
+                               const int x0, const int x1, const int y0, const int y1, const float threshold)
+{
+    for (int c = 0; c < 3; c++)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            const float* pa = a[c] + y * stride;
+            const float* pb = b[c] + y * stride;
+
+            if (threshold == 0.f)
+            {
+                if (std::memcmp(pa + x0, pb + x0, (x1 - x0) * sizeof(float)) != 0)
+                    return false;
+
+                continue;
+            }
+
+            for (int x = x0; x < x1; x++)
+            {
+                if (std::abs(pa[x] - pb[x]) > threshold)
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// offset of sample x, y in orientation ti of a w x h image, as laid out by the tta preproc shaders
+static inline int tta_offset(const int ti, const int x, const int y, const int w, const int h)
+{
+    switch (ti)
+    {
+    case 1: return y * w + (w - 1 - x);
+    case 2: return (h - 1 - y) * w + (w - 1 - x);
+    case 3: return (h - 1 - y) * w + x;
+    case 4: return x * h + y;
+    case 5: return x * h + (h - 1 - y);
+    case 6: return (w - 1 - x) * h + (h - 1 - y);
+    case 7: return (w - 1 - x) * h + y;
+    default: return y * w + x;
+    }
+}
+
+// the build baseline stays sse2, avx2 and avx512 copies of the host row loops are picked at runtime
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define WAIFU2X_X86_DISPATCH 1
+#endif
+
+namespace waifu2x_generic {
+#include "waifu2x_host_kernels.h"
+} // namespace waifu2x_generic
+
+#if WAIFU2X_X86_DISPATCH
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace waifu2x_avx2 {
+#include "waifu2x_host_kernels.h"
+} // namespace waifu2x_avx2
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f,fma")
+#endif
+namespace waifu2x_avx512 {
+#include "waifu2x_host_kernels.h"
+} // namespace waifu2x_avx512
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif // WAIFU2X_X86_DISPATCH
+
+struct HostKernels
+{
+    decltype(&waifu2x_generic::tile_stats_row) tile_stats_row;
+    decltype(&waifu2x_generic::preproc_row) preproc_row;
+    decltype(&waifu2x_generic::scatter_row) scatter_row;
+    decltype(&waifu2x_generic::accumulate_row) accumulate_row;
+    decltype(&waifu2x_generic::scale_row) scale_row;
+};
+
+#define WAIFU2X_HOST_KERNELS(ns) { ns::tile_stats_row, ns::preproc_row, ns::scatter_row, ns::accumulate_row, ns::scale_row }
+
+static HostKernels select_host_kernels()
+{
+#if WAIFU2X_X86_DISPATCH
+    if (ncnn::cpu_support_x86_avx512())
+        return WAIFU2X_HOST_KERNELS(waifu2x_avx512);
+
+    if (ncnn::cpu_support_x86_avx2() && ncnn::cpu_support_x86_fma())
+        return WAIFU2X_HOST_KERNELS(waifu2x_avx2);
+#endif
+
+    return WAIFU2X_HOST_KERNELS(waifu2x_generic);
+}
+
+static const HostKernels& host_kernels()
+{
+    static const HostKernels kernels = select_host_kernels();
+    return kernels;
+}
+
+// copies read back rows into the frame on its own thread, while the calling thread uploads and runs the next row
+class RowCopyWorker
+{
+public:
+    RowCopyWorker() : busy(false), stop(false)
+    {
+        thread = new ncnn::Thread(run, this);
+    }
+
+    ~RowCopyWorker()
+    {
+        {
+            ncnn::MutexLockGuard guard(lock);
+            stop = true;
+            condition.broadcast();
+        }
+
+        thread->join();
+        delete thread;
+    }
+
+    // waits for the previous row first, out is kept referenced until it is copied
+    void submit(const ncnn::Mat& _out, float* dstR, float* dstG, float* dstB, const ptrdiff_t _dst_stride)
+    {
+        ncnn::MutexLockGuard guard(lock);
+        while (busy)
+            condition.wait(lock);
+
+        out = _out;
+        dst[0] = dstR;
+        dst[1] = dstG;
+        dst[2] = dstB;
+        dst_stride = _dst_stride;
+        busy = true;
+        condition.broadcast();
+    }
+
+    void wait()
+    {
+        ncnn::MutexLockGuard guard(lock);
+        while (busy)
+            condition.wait(lock);
+    }
+
+private:
+    static void* run(void* args)
+    {
+        RowCopyWorker* worker = (RowCopyWorker*)args;
 
-Waifu2x::Waifu2x(int gpuid, bool _tta_mode, int num_threads)
+        worker->lock.lock();
+        for (;;)
+        {
+            while (!worker->busy && !worker->stop)
+                worker->condition.wait(worker->lock);
+
+            if (!worker->busy)
+                break;
+
+            worker->lock.unlock();
+
+            // already off the calling thread, so no nested openmp team on top
+            for (int q = 0; q < 3; q++)
+                copy_plane(worker->out.channel(q), worker->out.w, worker->dst[q], worker->dst_stride, worker->out.w, worker->out.h, true, false);
+
+            worker->lock.lock();
+            worker->out.release();
+            worker->busy = false;
+            worker->condition.broadcast();
+        }
+        worker->lock.unlock();
+
+        return 0;
+    }
+
+private:
+    ncnn::Mutex lock;
+    ncnn::ConditionVariable condition;
+    bool busy;
+    bool stop;
+
+    ncnn::Mat out;
+    float* dst[3];
+    ptrdiff_t dst_stride;
+
+    ncnn::Thread* thread;
+};
+
+// memory type for buffers with the usage ncnn gives staging and blob buffers alike, from a probe buffer
+uint32_t find_buffer_memory_type(const ncnn::VulkanDevice* vkdev, VkFlags required, VkFlags preferred, VkFlags preferred_not)
+{
+    ncnn::VkStagingAllocator probe_vkallocator(vkdev);
+
+    ncnn::VkBufferMemory* probe = probe_vkallocator.fastMalloc(4);
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(vkdev->vkdevice(), probe->buffer, &memoryRequirements);
+
+    probe_vkallocator.fastFree(probe);
+
+    // quietly report types the device does not have at all
+    const VkPhysicalDeviceMemoryProperties& memory_properties = vkdev->info.physical_device_memory_properties();
+
+    bool found = false;
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+    {
+        if ((memoryRequirements.memoryTypeBits & (1u << i)) && (memory_properties.memoryTypes[i].propertyFlags & required) == required)
+            found = true;
+    }
+
+    if (!found)
+        return (uint32_t)-1;
+
+    return vkdev->find_memory_index(memoryRequirements.memoryTypeBits, required, preferred, preferred_not);
+}
+
+Waifu2xAllocatorPool::Waifu2xAllocatorPool(const ncnn::VulkanDevice* _vkdev, const uint32_t _memory_type_index, const bool _staging)
+    : memory_type_index(_memory_type_index), vkdev(_vkdev), staging(_staging)
+{
+}
+
+Waifu2xAllocatorPool::~Waifu2xAllocatorPool()
+{
+    for (size_t i = 0; i < allocators.size(); i++)
+        delete allocators[i];
+}
+
+ncnn::VkAllocator* Waifu2xAllocatorPool::acquire()
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    if (!idle.empty())
+    {
+        ncnn::VkAllocator* allocator = idle.back();
+        idle.pop_back();
+        return allocator;
+    }
+
+    ncnn::VkAllocator* allocator = staging ? (ncnn::VkAllocator*)new ncnn::VkStagingAllocator(vkdev) : new ncnn::VkBlobAllocator(vkdev);
+
+    // preset so that fastMalloc keeps it, invalidation and flushing follow from coherent
+    allocator->buffer_memory_type_index = memory_type_index;
+    allocator->mappable = vkdev->is_mappable(memory_type_index);
+    allocator->coherent = vkdev->is_coherent(memory_type_index);
+
+    allocators.push_back(allocator);
+
+    return allocator;
+}
+
+void Waifu2xAllocatorPool::reclaim(ncnn::VkAllocator* allocator)
+{
+    ncnn::MutexLockGuard guard(lock);
+
+    idle.push_back(allocator);
+}
+
+// host writes straight into a buffer in device memory, which the preproc shader reads without a staging copy
+static void upload_mapped(const float* srcR, const float* srcG, const float* srcB, const ptrdiff_t srcStride, const int w, const int h,
+                          ncnn::VkMat& dst, ncnn::VkAllocator* allocator)
+{
+    dst.create(w, h, 3, (size_t)4u, 1, allocator);
+
+    ncnn::Mat mapped = dst.mapped();
+    copy_plane(srcR, srcStride, mapped.channel(0), w, w, h);
+    copy_plane(srcG, srcStride, mapped.channel(1), w, w, h);
+    copy_plane(srcB, srcStride, mapped.channel(2), w, w, h);
+
+    allocator->flush(dst.data);
+
+    // so that the first pipeline reading it waits for the host writes
+    dst.data->access_flags = VK_ACCESS_HOST_WRITE_BIT;
+    dst.data->stage_flags = VK_PIPELINE_STAGE_HOST_BIT;
+}
+
+Waifu2x::Waifu2x(int gpuid, int _tta_mode, int num_threads, bool _tta_stream)
 {
     vkdev = gpuid == -1 ? 0 : ncnn::get_gpu_device(gpuid);
 
@@ -19,8 +326,35 @@ Waifu2x::Waifu2x(int gpuid, bool _tta_mode, int num_threads)
 
     waifu2x_preproc = 0;
     waifu2x_postproc = 0;
+    waifu2x_tta_diff = 0;
+    waifu2x_tile_copy = 0;
+    waifu2x_tile_stats = 0;
+    waifu2x_tile_fill = 0;
     bicubic_2x = 0;
+    bicubic_resize = 0;
+    upconv7 = 0;
+    upconv7_fast = 0;
     tta_mode = _tta_mode;
+    tta_stream = _tta_stream;
+
+    tta_threshold = 0.f;
+    target_width = 0;
+    target_height = 0;
+    tile_reuse = false;
+    tile_reuse_threshold = 0.f;
+    flat_skip = false;
+    flat_threshold = 0.f;
+    hybrid = false;
+    hybrid_threshold = 0.f;
+    prepadding_fast = 0;
+    deterministic = false;
+
+    tile_cache_vkallocator = 0;
+    upload_pool = 0;
+    download_pool = 0;
+    mapped_upload_pool = 0;
+    mapped_download_pool = 0;
+    transfer_queue = false;
 }
 
 Waifu2x::~Waifu2x()
@@ -29,26 +363,45 @@ Waifu2x::~Waifu2x()
     {
         delete waifu2x_preproc;
         delete waifu2x_postproc;
+        delete waifu2x_tta_diff;
+        delete waifu2x_tile_copy;
+        delete waifu2x_tile_stats;
+        delete waifu2x_tile_fill;
     }
 
+    delete upconv7;
+    delete upconv7_fast;
+
+    // cached tiles go back to their allocator first
+    tile_cache.clear();
+    delete tile_cache_vkallocator;
+
+    delete upload_pool;
+    delete download_pool;
+    delete mapped_upload_pool;
+    delete mapped_download_pool;
+
     bicubic_2x->destroy_pipeline(net.opt);
     delete bicubic_2x;
+
+    if (bicubic_resize)
+    {
+        ncnn::Option resize_opt = net.opt;
+        resize_opt.use_fp16_packed = false;
+        resize_opt.use_fp16_storage = false;
+        resize_opt.use_fp16_arithmetic = false;
+
+        bicubic_resize->destroy_pipeline(resize_opt);
+        delete bicubic_resize;
+    }
 }
 
 #if _WIN32
-int Waifu2x::load(const std::wstring& parampath, const std::wstring& modelpath, const bool fp32)
+static void load_net(ncnn::Net& net, const std::wstring& parampath, const std::wstring& modelpath)
 #else
-int Waifu2x::load(const std::string& parampath, const std::string& modelpath, const bool fp32)
+static void load_net(ncnn::Net& net, const std::string& parampath, const std::string& modelpath)
 #endif
 {
-    net.opt.use_vulkan_compute = vkdev ? true : false;
-    net.opt.use_fp16_packed = !fp32;
-    net.opt.use_fp16_storage = !fp32;
-    net.opt.use_fp16_arithmetic = false;
-    net.opt.use_int8_storage = false;
-
-    net.set_vulkan_device(vkdev);
-
 #if _WIN32
     {
         FILE* fp = _wfopen(parampath.c_str(), L"rb");
@@ -76,10 +429,76 @@ int Waifu2x::load(const std::string& parampath, const std::string& modelpath, co
     net.load_param(parampath.c_str());
     net.load_model(modelpath.c_str());
 #endif
+}
+
+#if _WIN32
+static Upconv7* load_upconv7(const std::wstring& parampath, const std::wstring& modelpath)
+#else
+static Upconv7* load_upconv7(const std::string& parampath, const std::string& modelpath)
+#endif
+{
+    Upconv7* engine = new Upconv7;
+    if (engine->load(parampath, modelpath) != 0)
+    {
+        // not an upconv_7 model, ncnn runs it
+        delete engine;
+        return 0;
+    }
+
+    return engine;
+}
+
+#if _WIN32
+int Waifu2x::load(const std::wstring& parampath, const std::wstring& modelpath, const bool fp32)
+#else
+int Waifu2x::load(const std::string& parampath, const std::string& modelpath, const bool fp32)
+#endif
+{
+    net.opt.use_vulkan_compute = vkdev ? true : false;
+    net.opt.use_fp16_packed = !fp32;
+    net.opt.use_fp16_storage = !fp32;
+    net.opt.use_fp16_arithmetic = false;
+    net.opt.use_int8_storage = false;
+
+    // ncnn picks winograd or sgemm per blob shape and device, each summing in its own order
+    if (deterministic)
+    {
+        net.opt.use_winograd_convolution = false;
+        net.opt.use_sgemm_convolution = false;
+    }
+
+    net.set_vulkan_device(vkdev);
+
+    // the fused engine keeps its own copy of the weights, ncnn only loads what it runs
+    if (!vkdev)
+        upconv7 = load_upconv7(parampath, modelpath);
+
+    if (!upconv7)
+        load_net(net, parampath, modelpath);
 
     // initialize preprocess and postprocess pipeline
     if (vkdev)
     {
+        // write-combined memory is fast to fill but slow to read back from on the host
+        // a transfer only queue family does the upload copies with its own dma engine
+        transfer_queue = vkdev->info.transfer_queue_count() > 0 && vkdev->info.transfer_queue_family_index() != vkdev->info.compute_queue_family_index();
+
+        upload_pool = new Waifu2xAllocatorPool(vkdev, find_buffer_memory_type(vkdev, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT), true);
+        download_pool = new Waifu2xAllocatorPool(vkdev, find_buffer_memory_type(vkdev, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_CACHED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT), true);
+
+        // unified memory and resizable bar, frames go in and out of device memory through the host mapping
+        // small bar windows are left alone, and the output is read back only from cached memory
+        const VkPhysicalDeviceMemoryProperties& memory_properties = vkdev->info.physical_device_memory_properties();
+        const VkDeviceSize min_mapped_heap = (VkDeviceSize)1 << 30;
+
+        const uint32_t mapped_type = find_buffer_memory_type(vkdev, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0);
+        if (mapped_type != (uint32_t)-1 && memory_properties.memoryHeaps[memory_properties.memoryTypes[mapped_type].heapIndex].size >= min_mapped_heap)
+            mapped_upload_pool = new Waifu2xAllocatorPool(vkdev, mapped_type, false);
+
+        const uint32_t mapped_cached_type = find_buffer_memory_type(vkdev, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0);
+        if (mapped_cached_type != (uint32_t)-1 && memory_properties.memoryHeaps[memory_properties.memoryTypes[mapped_cached_type].heapIndex].size >= min_mapped_heap)
+            mapped_download_pool = new Waifu2xAllocatorPool(vkdev, mapped_cached_type, false);
+
         std::vector<ncnn::vk_specialization_type> specializations(1);
 #if _WIN32
         specializations[0].i = 1;
@@ -94,7 +513,13 @@ int Waifu2x::load(const std::string& parampath, const std::string& modelpath, co
                 ncnn::MutexLockGuard guard(lock);
                 if (spirv.empty())
                 {
-                    if (tta_mode)
+                    if (tta_mode && tta_stream)
+                        compile_spirv_module(waifu2x_preproc_tta_stream_comp_data, sizeof(waifu2x_preproc_tta_stream_comp_data), net.opt, spirv);
+                    else if (tta_mode == 2)
+                        compile_spirv_module(waifu2x_preproc_tta2_comp_data, sizeof(waifu2x_preproc_tta2_comp_data), net.opt, spirv);
+                    else if (tta_mode == 4)
+                        compile_spirv_module(waifu2x_preproc_tta4_comp_data, sizeof(waifu2x_preproc_tta4_comp_data), net.opt, spirv);
+                    else if (tta_mode)
                         compile_spirv_module(waifu2x_preproc_tta_comp_data, sizeof(waifu2x_preproc_tta_comp_data), net.opt, spirv);
                     else
                         compile_spirv_module(waifu2x_preproc_comp_data, sizeof(waifu2x_preproc_comp_data), net.opt, spirv);
@@ -113,7 +538,13 @@ int Waifu2x::load(const std::string& parampath, const std::string& modelpath, co
                 ncnn::MutexLockGuard guard(lock);
                 if (spirv.empty())
                 {
-                    if (tta_mode)
+                    if (tta_mode && tta_stream)
+                        compile_spirv_module(waifu2x_postproc_tta_stream_comp_data, sizeof(waifu2x_postproc_tta_stream_comp_data), net.opt, spirv);
+                    else if (tta_mode == 2)
+                        compile_spirv_module(waifu2x_postproc_tta2_comp_data, sizeof(waifu2x_postproc_tta2_comp_data), net.opt, spirv);
+                    else if (tta_mode == 4)
+                        compile_spirv_module(waifu2x_postproc_tta4_comp_data, sizeof(waifu2x_postproc_tta4_comp_data), net.opt, spirv);
+                    else if (tta_mode)
                         compile_spirv_module(waifu2x_postproc_tta_comp_data, sizeof(waifu2x_postproc_tta_comp_data), net.opt, spirv);
                     else
                         compile_spirv_module(waifu2x_postproc_comp_data, sizeof(waifu2x_postproc_comp_data), net.opt, spirv);
@@ -124,6 +555,80 @@ int Waifu2x::load(const std::string& parampath, const std::string& modelpath, co
             waifu2x_postproc->set_optimal_local_size_xyz(8, 8, 3);
             waifu2x_postproc->create(spirv.data(), spirv.size() * 4, specializations);
         }
+
+        // orientation disagreement for adaptive tta
+        if (tta_mode && tta_stream)
+        {
+            std::vector<uint32_t> spirv;
+            static ncnn::Mutex lock;
+            {
+                ncnn::MutexLockGuard guard(lock);
+                if (spirv.empty())
+                {
+                    compile_spirv_module(waifu2x_tta_diff_comp_data, sizeof(waifu2x_tta_diff_comp_data), net.opt, spirv);
+                }
+            }
+
+            waifu2x_tta_diff = new ncnn::Pipeline(vkdev);
+            waifu2x_tta_diff->set_optimal_local_size_xyz(64, 3, 1);
+            waifu2x_tta_diff->create(spirv.data(), spirv.size() * 4, specializations);
+        }
+
+        // copy between out_gpu and the tile cache
+        if (tile_reuse)
+        {
+            std::vector<uint32_t> spirv;
+            static ncnn::Mutex lock;
+            {
+                ncnn::MutexLockGuard guard(lock);
+                if (spirv.empty())
+                {
+                    compile_spirv_module(waifu2x_tile_copy_comp_data, sizeof(waifu2x_tile_copy_comp_data), net.opt, spirv);
+                }
+            }
+
+            waifu2x_tile_copy = new ncnn::Pipeline(vkdev);
+            waifu2x_tile_copy->set_optimal_local_size_xyz(8, 8, 3);
+            waifu2x_tile_copy->create(spirv.data(), spirv.size() * 4, specializations);
+
+            tile_cache_vkallocator = new ncnn::VkBlobAllocator(vkdev);
+        }
+
+        // flat tile detection and fill, detail metric for hybrid mode
+        if (flat_skip || hybrid)
+        {
+            {
+                std::vector<uint32_t> spirv;
+                static ncnn::Mutex lock;
+                {
+                    ncnn::MutexLockGuard guard(lock);
+                    if (spirv.empty())
+                    {
+                        compile_spirv_module(waifu2x_tile_stats_comp_data, sizeof(waifu2x_tile_stats_comp_data), net.opt, spirv);
+                    }
+                }
+
+                waifu2x_tile_stats = new ncnn::Pipeline(vkdev);
+                waifu2x_tile_stats->set_optimal_local_size_xyz(4, 16, 3);
+                waifu2x_tile_stats->create(spirv.data(), spirv.size() * 4, specializations);
+            }
+
+            {
+                std::vector<uint32_t> spirv;
+                static ncnn::Mutex lock;
+                {
+                    ncnn::MutexLockGuard guard(lock);
+                    if (spirv.empty())
+                    {
+                        compile_spirv_module(waifu2x_tile_fill_comp_data, sizeof(waifu2x_tile_fill_comp_data), net.opt, spirv);
+                    }
+                }
+
+                waifu2x_tile_fill = new ncnn::Pipeline(vkdev);
+                waifu2x_tile_fill->set_optimal_local_size_xyz(8, 8, 3);
+                waifu2x_tile_fill->create(spirv.data(), spirv.size() * 4, specializations);
+            }
+        }
     }
 
     // bicubic 2x for alpha channel
@@ -140,288 +645,501 @@ int Waifu2x::load(const std::string& parampath, const std::string& modelpath, co
         bicubic_2x->create_pipeline(net.opt);
     }
 
+    // bicubic resampling of the fp32 output frame to the target size
+    if (target_width)
+    {
+        ncnn::Option resize_opt = net.opt;
+        resize_opt.use_fp16_packed = false;
+        resize_opt.use_fp16_storage = false;
+        resize_opt.use_fp16_arithmetic = false;
+
+        bicubic_resize = ncnn::create_layer("Interp");
+        bicubic_resize->vkdev = vkdev;
+
+        ncnn::ParamDict pd;
+        pd.set(0, 3);// bicubic
+        pd.set(3, target_height);
+        pd.set(4, target_width);
+        bicubic_resize->load_param(pd);
+
+        bicubic_resize->create_pipeline(resize_opt);
+    }
+
     return 0;
 }
 
-int Waifu2x::process(const float* srcR, const float* srcG, const float* srcB,
-                     float* dstR, float* dstG, float* dstB,
-                     const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride) const
+#if _WIN32
+int Waifu2x::load_fast(const std::wstring& parampath, const std::wstring& modelpath)
+#else
+int Waifu2x::load_fast(const std::string& parampath, const std::string& modelpath)
+#endif
 {
-    constexpr int channels = 3;
+    net_fast.opt = net.opt;
 
-    const int TILE_SIZE_X = tile_w;
-    const int TILE_SIZE_Y = tile_h;
+    net_fast.set_vulkan_device(vkdev);
 
-    ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
-    ncnn::VkAllocator* staging_vkallocator = vkdev->acquire_staging_allocator();
+    if (!vkdev)
+        upconv7_fast = load_upconv7(parampath, modelpath);
 
-    ncnn::Option opt = net.opt;
-    opt.blob_vkallocator = blob_vkallocator;
-    opt.workspace_vkallocator = blob_vkallocator;
-    opt.staging_vkallocator = staging_vkallocator;
+    if (!upconv7_fast)
+        load_net(net_fast, parampath, modelpath);
 
-    // each tile 400x400
-    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
-    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+    return 0;
+}
 
-    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+uint32_t Waifu2x::upload_memory_type() const
+{
+    if (mapped_upload_pool)
+        return mapped_upload_pool->memory_type_index;
 
-    //#pragma omp parallel for num_threads(2)
-    for (int yi = 0; yi < ytiles; yi++)
+    return upload_pool ? upload_pool->memory_type_index : (uint32_t)-1;
+}
+
+uint32_t Waifu2x::download_memory_type() const
+{
+    if (mapped_download_pool)
+        return mapped_download_pool->memory_type_index;
+
+    return download_pool ? download_pool->memory_type_index : (uint32_t)-1;
+}
+
+size_t Waifu2x::tile_memory() const
+{
+    // cunet, told apart by the global pooling of its SE blocks, runs its second unet at twice the input size
+    bool cunet = false;
+    for (size_t i = 0; i < net.layers().size(); i++)
     {
-        const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
+        if (net.layers()[i]->type == "Pooling")
+            cunet = true;
+    }
 
-        int prepadding_bottom = prepadding;
-        if (scale == 1)
-        {
-            prepadding_bottom += (tile_h_nopad + 3) / 4 * 4 - tile_h_nopad;
-        }
-        if (scale == 2)
-        {
-            prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
-        }
+    // blobs alive at once per pixel of the padded tile input, mostly the ones kept for the skip connections
+    const size_t values_per_pixel = cunet ? 800 : 400;
+    const size_t elemsize = net.opt.use_fp16_storage ? 2 : 4;
 
-        int in_tile_y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
-        int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom, h);
+    return (size_t)(tile_w + prepadding * 2) * (tile_h + prepadding * 2) * values_per_pixel * elemsize;
+}
 
-        ncnn::Mat in;
-        in.create(w, in_tile_y1 - in_tile_y0, channels, (size_t)4u, 1);
-        float* inR{ in.channel(0) };
-        float* inG{ in.channel(1) };
-        float* inB{ in.channel(2) };
-        for (auto y{ 0 }; y < in.h; y++) {
-            std::memcpy(inR + y * in.w, srcR + (in_tile_y0 + y) * srcStride, in.w * sizeof(float));
-            std::memcpy(inG + y * in.w, srcG + (in_tile_y0 + y) * srcStride, in.w * sizeof(float));
-            std::memcpy(inB + y * in.w, srcB + (in_tile_y0 + y) * srcStride, in.w * sizeof(float));
-        }
+size_t Waifu2x::device_memory() const
+{
+    if (!vkdev)
+        return 0;
 
-        ncnn::VkCompute cmd(vkdev);
+    const VkPhysicalDeviceMemoryProperties& memory_properties = vkdev->info.physical_device_memory_properties();
 
-        // upload
-        ncnn::VkMat in_gpu;
-        {
-            cmd.record_clone(in, in_gpu, opt);
+    VkDeviceSize size = 0;
+    for (uint32_t i = 0; i < memory_properties.memoryHeapCount; i++)
+    {
+        if (memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+            size = std::max(size, memory_properties.memoryHeaps[i].size);
+    }
 
-            if (xtiles > 1)
+    return (size_t)size;
+}
+
+int Waifu2x::process(const float* srcR, const float* srcG, const float* srcB,
+                     float* dstR, float* dstG, float* dstB,
+                     const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                     Waifu2xStats* stats, const Waifu2xReuse* reuse) const
+{
+    if (!vkdev)
+        return process_cpu(srcR, srcG, srcB, dstR, dstG, dstB, w, h, srcStride, dstStride, stats);
+
+    if (!tile_reuse || !reuse)
+        return process_gpu(srcR, srcG, srcB, dstR, dstG, dstB, w, h, srcStride, dstStride, stats, 0, 0, 0);
+
+    // the first thread to need the tiles of an anchor upscales it, the others wait for them
+    std::shared_ptr<AnchorTiles> tiles;
+    bool owner = false;
+    {
+        ncnn::MutexLockGuard guard(tile_cache_lock);
+
+        for (size_t i = 0; i < tile_cache.size(); i++)
+        {
+            const AnchorTiles& t = *tile_cache[i];
+            if (t.frame == reuse->anchor && t.x == reuse->x && t.y == reuse->y && t.w == w && t.h == h)
+                tiles = tile_cache[i];
+        }
+
+        if (!tiles)
+        {
+            tiles = std::make_shared<AnchorTiles>();
+            tiles->frame = reuse->anchor;
+            tiles->x = reuse->x;
+            tiles->y = reuse->y;
+            tiles->w = w;
+            tiles->h = h;
+            tiles->done = false;
+
+            if (tile_cache.size() >= 2)
+                tile_cache.erase(tile_cache.begin());
+            tile_cache.push_back(tiles);
+
+            owner = true;
+        }
+        else if (reuse->frame != reuse->anchor)
+        {
+            while (!tiles->done)
+                tile_cache_done.wait(tile_cache_lock);
+        }
+    }
+
+    int ret = 0;
+    if (owner)
+    {
+        if (reuse->frame == reuse->anchor)
+        {
+            ret = process_gpu(srcR, srcG, srcB, dstR, dstG, dstB, w, h, srcStride, dstStride, stats, 0, 0, tiles.get());
+        }
+        else
+        {
+            // the anchor has not been upscaled yet, or its tiles were dropped, so they are made from its source
+            const int out_w = w * scale;
+            const int out_h = h * scale;
+            std::vector<float> anchor_out((size_t)out_w * out_h * 3);
+            float* outR = anchor_out.data();
+            float* outG = outR + (size_t)out_w * out_h;
+            float* outB = outG + (size_t)out_w * out_h;
+
+            ret = process_gpu(reuse->anchorR, reuse->anchorG, reuse->anchorB, outR, outG, outB, w, h, srcStride, out_w, 0, 0, 0, tiles.get());
+        }
+
+        ncnn::MutexLockGuard guard(tile_cache_lock);
+        tiles->done = true;
+        tile_cache_done.broadcast();
+    }
+
+    if (reuse->frame == reuse->anchor)
+    {
+        // upscaled fresh either way, another thread only got to the tiles first
+        if (!owner)
+            ret = process_gpu(srcR, srcG, srcB, dstR, dstG, dstB, w, h, srcStride, dstStride, stats, 0, 0, 0);
+    }
+    else if (ret == 0)
+    {
+        ret = process_gpu(srcR, srcG, srcB, dstR, dstG, dstB, w, h, srcStride, dstStride, stats, reuse, tiles.get(), 0);
+    }
+
+    // the cached tiles go back to the shared allocator under the lock
+    ncnn::MutexLockGuard guard(tile_cache_lock);
+    tiles.reset();
+
+    return ret;
+}
+
+int Waifu2x::process_gpu(const float* srcR, const float* srcG, const float* srcB,
+                         float* dstR, float* dstG, float* dstB,
+                         const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                         Waifu2xStats* stats, const Waifu2xReuse* reuse, const AnchorTiles* reuse_from, AnchorTiles* store) const
+{
+    constexpr int channels = 3;
+
+    const int TILE_SIZE_X = tile_w;
+    const int TILE_SIZE_Y = tile_h;
+
+    // scale 4 and 8 chain 2x passes of the same network
+    const int model_scale = scale == 1 ? 1 : 2;
+    const int passes = scale == 8 ? 3 : scale == 4 ? 2 : 1;
+
+    ncnn::VkAllocator* blob_vkallocator = vkdev->acquire_blob_allocator();
+    ncnn::VkAllocator* upload_vkallocator = upload_pool->acquire();
+    ncnn::VkAllocator* download_vkallocator = download_pool->acquire();
+
+    // uploads are staged in write-combined memory, readback in host cached memory
+    ncnn::Option opt = net.opt;
+    opt.blob_vkallocator = blob_vkallocator;
+    opt.workspace_vkallocator = blob_vkallocator;
+    opt.staging_vkallocator = upload_vkallocator;
+
+    ncnn::Option download_opt = opt;
+    download_opt.staging_vkallocator = download_vkallocator;
+
+    // device memory the host can map, 0 where staging copies are needed
+    ncnn::VkAllocator* mapped_upload_vkallocator = mapped_upload_pool ? mapped_upload_pool->acquire() : 0;
+    ncnn::VkAllocator* mapped_download_vkallocator = mapped_download_pool ? mapped_download_pool->acquire() : 0;
+
+    // one command buffer for the whole frame, reset after each submission rather than created per row
+    // the dispatches are still recorded again for every tile of every frame, the extractor records the network
+    // layer by layer into a begun command buffer and allocates descriptor sets as it goes, ncnn has no way to replay them
+    ncnn::VkCompute cmd(vkdev);
+
+    // input size of the last pass
+    int pass_w = w;
+    int pass_h = h;
+
+    // the whole frame stays on the gpu between chained passes and for resampling
+    const int frame_passes = target_width ? passes : passes - 1;
+
+    ncnn::VkMat in_frame_gpu;
+    if (frame_passes > 0)
+    {
+        // upload
+        if (mapped_upload_vkallocator)
+        {
+            upload_mapped(srcR, srcG, srcB, srcStride, w, h, in_frame_gpu, mapped_upload_vkallocator);
+        }
+        else
+        {
+            ncnn::Mat in;
+            in.create(w, h, channels, (size_t)4u, 1);
+            float* inR{ in.channel(0) };
+            float* inG{ in.channel(1) };
+            float* inB{ in.channel(2) };
+            copy_plane(srcR, srcStride, inR, in.w, in.w, in.h);
+            copy_plane(srcG, srcStride, inG, in.w, in.w, in.h);
+            copy_plane(srcB, srcStride, inB, in.w, in.w, in.h);
+
+            if (record_upload(cmd, in, in_frame_gpu, opt))
             {
                 cmd.submit_and_wait();
                 cmd.reset();
             }
         }
 
-        int out_tile_y0 = std::max(yi * TILE_SIZE_Y, 0);
-        int out_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h);
+        for (int pi = 0; pi < frame_passes; pi++)
+        {
+            const int xtiles = (pass_w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+            const int ytiles = (pass_h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
 
-        ncnn::VkMat out_gpu;
-        out_gpu.create(w * scale, (out_tile_y1 - out_tile_y0) * scale, channels, (size_t)4u, 1, blob_vkallocator);
+            ncnn::VkMat out_frame_gpu;
+            out_frame_gpu.create(pass_w * model_scale, pass_h * model_scale, channels, (size_t)4u, 1, blob_vkallocator);
 
-        for (int xi = 0; xi < xtiles; xi++)
+            for (int yi = 0; yi < ytiles; yi++)
+            {
+                const int out_h = (std::min((yi + 1) * TILE_SIZE_Y, pass_h) - yi * TILE_SIZE_Y) * model_scale;
+                const int out_offset = yi * TILE_SIZE_Y * model_scale * out_frame_gpu.w;
+
+                std::vector<unsigned char> flat;
+                std::vector<float> flat_values;
+                std::vector<float> energy;
+                if (flat_skip || hybrid)
+                {
+                    const int rows = std::min((yi + 1) * TILE_SIZE_Y, pass_h) - yi * TILE_SIZE_Y;
+                    analyze_tiles(cmd, in_frame_gpu, yi * TILE_SIZE_Y, rows, xtiles, download_opt, flat, flat_values, energy);
+                }
+
+                for (int xi = 0; xi < xtiles; xi++)
+                {
+                    if (flat_skip && flat[xi])
+                    {
+                        const int tile_out_x = xi * TILE_SIZE_X * model_scale;
+                        const int tile_out_w = std::min(TILE_SIZE_X * model_scale, out_frame_gpu.w - tile_out_x);
+
+                        record_tile_fill(cmd, out_frame_gpu, out_offset + tile_out_x, tile_out_w, out_h, &flat_values[xi * channels]);
+
+                        if (stats)
+                        {
+                            stats->tiles++;
+                            stats->tiles_flat++;
+                        }
+
+                        continue;
+                    }
+
+                    const bool fast = hybrid && energy[xi] < hybrid_threshold;
+
+                    process_tile(cmd, in_frame_gpu, out_frame_gpu, xi, yi, pass_w, pass_h, yi * TILE_SIZE_Y, out_offset, out_h, download_opt, stats, fast);
+
+                    cmd.submit_and_wait();
+                    cmd.reset();
+                }
+            }
+
+            // fills of flat tiles after the last network tile are only recorded so far
+            cmd.submit_and_wait();
+            cmd.reset();
+
+            in_frame_gpu = out_frame_gpu;
+            pass_w *= model_scale;
+            pass_h *= model_scale;
+        }
+
+        // resample to the target size, only the final frame is read back
+        if (target_width)
         {
-            const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+            ncnn::Option resize_opt = opt;
+            resize_opt.use_fp16_packed = false;
+            resize_opt.use_fp16_storage = false;
+            resize_opt.use_fp16_arithmetic = false;
 
-            int prepadding_right = prepadding;
-            if (scale == 1)
+            // read back straight from the mapping of device memory
+            if (mapped_download_vkallocator)
+                resize_opt.blob_vkallocator = mapped_download_vkallocator;
+
+            ncnn::VkMat out_gpu;
+            bicubic_resize->forward(in_frame_gpu, out_gpu, cmd, resize_opt);
+
+            // download
+            ncnn::Mat out;
+
+            cmd.record_clone(out_gpu, out, download_opt);
+
+            cmd.submit_and_wait();
+            cmd.reset();
+
+            const float* outR{ out.channel(0) };
+            const float* outG{ out.channel(1) };
+            const float* outB{ out.channel(2) };
+            copy_plane(outR, out.w, dstR, dstStride, out.w, out.h, true);
+            copy_plane(outG, out.w, dstG, dstStride, out.w, out.h, true);
+            copy_plane(outB, out.w, dstB, dstStride, out.w, out.h, true);
+
+            // the allocators may go to another thread once reclaimed
+            out_gpu.release();
+            in_frame_gpu.release();
+
+            vkdev->reclaim_blob_allocator(blob_vkallocator);
+            upload_pool->reclaim(upload_vkallocator);
+            download_pool->reclaim(download_vkallocator);
+            if (mapped_upload_vkallocator)
+                mapped_upload_pool->reclaim(mapped_upload_vkallocator);
+            if (mapped_download_vkallocator)
+                mapped_download_pool->reclaim(mapped_download_vkallocator);
+
+            return 0;
+        }
+    }
+
+    // each tile 400x400
+    const int xtiles = (pass_w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = (pass_h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    if (store)
+        store->out.resize(xtiles * ytiles);
+
+    // host copy of the last row read back, done while the next row uploads and runs
+    // one thread for the whole frame rather than one per row
+    std::unique_ptr<RowCopyWorker> copy_worker;
+    if (ytiles > 1)
+        copy_worker.reset(new RowCopyWorker);
+
+    // the output of every row is written in full, so full height rows share one buffer
+    ncnn::VkMat out_gpu;
+
+    //#pragma omp parallel for num_threads(2)
+    for (int yi = 0; yi < ytiles; yi++)
+    {
+        // upload
+        ncnn::VkMat in_gpu;
+        int crop_y;
+        if (in_frame_gpu.empty())
+        {
+            const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
+
+            int prepadding_bottom = prepadding;
+            if (model_scale == 1)
             {
-                prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
+                prepadding_bottom += (tile_h_nopad + 3) / 4 * 4 - tile_h_nopad;
             }
-            if (scale == 2)
+            if (model_scale == 2)
             {
-                prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
+                prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
             }
 
-            if (tta_mode)
+            int in_tile_y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
+            int in_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding_bottom, h);
+
+            if (mapped_upload_vkallocator)
             {
-                // preproc
-                ncnn::VkMat in_tile_gpu[8];
-                ncnn::VkMat in_alpha_tile_gpu;
+                const ptrdiff_t src_offset = in_tile_y0 * srcStride;
+                upload_mapped(srcR + src_offset, srcG + src_offset, srcB + src_offset, srcStride, w, in_tile_y1 - in_tile_y0, in_gpu, mapped_upload_vkallocator);
+            }
+            else
+            {
+                ncnn::Mat in;
+                in.create(w, in_tile_y1 - in_tile_y0, channels, (size_t)4u, 1);
+                float* inR{ in.channel(0) };
+                float* inG{ in.channel(1) };
+                float* inB{ in.channel(2) };
+                copy_plane(srcR + in_tile_y0 * srcStride, srcStride, inR, in.w, in.w, in.h);
+                copy_plane(srcG + in_tile_y0 * srcStride, srcStride, inG, in.w, in.w, in.h);
+                copy_plane(srcB + in_tile_y0 * srcStride, srcStride, inB, in.w, in.w, in.h);
+
+                if (record_upload(cmd, in, in_gpu, opt) && xtiles > 1)
                 {
-                    // crop tile
-                    int tile_x0 = xi * TILE_SIZE_X - prepadding;
-                    int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
-
-                    in_tile_gpu[0].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[1].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[2].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[3].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[4].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[5].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[6].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-                    in_tile_gpu[7].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
-
-                    std::vector<ncnn::VkMat> bindings(10);
-                    bindings[0] = in_gpu;
-                    bindings[1] = in_tile_gpu[0];
-                    bindings[2] = in_tile_gpu[1];
-                    bindings[3] = in_tile_gpu[2];
-                    bindings[4] = in_tile_gpu[3];
-                    bindings[5] = in_tile_gpu[4];
-                    bindings[6] = in_tile_gpu[5];
-                    bindings[7] = in_tile_gpu[6];
-                    bindings[8] = in_tile_gpu[7];
-                    bindings[9] = in_alpha_tile_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
-                    constants[2].i = in_gpu.cstep;
-                    constants[3].i = in_tile_gpu[0].w;
-                    constants[4].i = in_tile_gpu[0].h;
-                    constants[5].i = in_tile_gpu[0].cstep;
-                    constants[6].i = prepadding;
-                    constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
-                    constants[10].i = channels;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = in_tile_gpu[0].w;
-                    dispatcher.h = in_tile_gpu[0].h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
+                    cmd.submit_and_wait();
+                    cmd.reset();
                 }
+            }
 
-                // waifu2x
-                ncnn::VkMat out_tile_gpu[8];
-                for (int ti = 0; ti < 8; ti++)
-                {
-                    ncnn::Extractor ex = net.create_extractor();
+            crop_y = std::min(yi * TILE_SIZE_Y, prepadding);
+        }
+        else
+        {
+            in_gpu = in_frame_gpu;
+            crop_y = yi * TILE_SIZE_Y;
+        }
 
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
+        int out_tile_y0 = std::max(yi * TILE_SIZE_Y, 0);
+        int out_tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, pass_h);
 
-                    ex.input("Input1", in_tile_gpu[ti]);
+        out_gpu.create(pass_w * model_scale, (out_tile_y1 - out_tile_y0) * model_scale, channels, (size_t)4u, 1, mapped_download_vkallocator ? mapped_download_vkallocator : blob_vkallocator);
 
-                    ex.extract("Eltwise4", out_tile_gpu[ti], cmd);
-                }
+        std::vector<unsigned char> flat;
+        std::vector<float> flat_values;
+        std::vector<float> energy;
+        if (flat_skip || hybrid)
+        {
+            analyze_tiles(cmd, in_gpu, crop_y, out_tile_y1 - out_tile_y0, xtiles, download_opt, flat, flat_values, energy);
+        }
+
+        for (int xi = 0; xi < xtiles; xi++)
+        {
+            const int tile_index = yi * xtiles + xi;
+            const int tile_out_x = xi * TILE_SIZE_X * model_scale;
+            const int tile_out_w = std::min(TILE_SIZE_X * model_scale, out_gpu.w - tile_out_x);
 
-                ncnn::VkMat out_alpha_tile_gpu;
+            if (flat_skip && flat[xi])
+            {
+                record_tile_fill(cmd, out_gpu, tile_out_x, tile_out_w, out_gpu.h, &flat_values[xi * channels]);
 
-                // postproc
+                if (stats)
                 {
-                    std::vector<ncnn::VkMat> bindings(10);
-                    bindings[0] = out_tile_gpu[0];
-                    bindings[1] = out_tile_gpu[1];
-                    bindings[2] = out_tile_gpu[2];
-                    bindings[3] = out_tile_gpu[3];
-                    bindings[4] = out_tile_gpu[4];
-                    bindings[5] = out_tile_gpu[5];
-                    bindings[6] = out_tile_gpu[6];
-                    bindings[7] = out_tile_gpu[7];
-                    bindings[8] = out_alpha_tile_gpu;
-                    bindings[9] = out_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(11);
-                    constants[0].i = out_tile_gpu[0].w;
-                    constants[1].i = out_tile_gpu[0].h;
-                    constants[2].i = out_tile_gpu[0].cstep;
-                    constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
-                    constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_X * scale;
-                    constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[8].i = channels;
-                    constants[9].i = out_alpha_tile_gpu.w;
-                    constants[10].i = out_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
+                    stats->tiles++;
+                    stats->tiles_flat++;
                 }
+
+                continue;
             }
-            else
-            {
-                // preproc
-                ncnn::VkMat in_tile_gpu;
-                ncnn::VkMat in_alpha_tile_gpu;
-                {
-                    // crop tile
-                    int tile_x0 = xi * TILE_SIZE_X - prepadding;
-                    int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
-                    int tile_y0 = yi * TILE_SIZE_Y - prepadding;
-                    int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
 
-                    in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+            if (reuse_from && tile_index < (int)reuse_from->out.size() && !reuse_from->out[tile_index].empty())
+            {
+                // the tile plus the prepadding it sees, alignment padding included
+                const int x0 = std::max(xi * TILE_SIZE_X - prepadding, 0);
+                const int x1 = std::min((xi + 1) * TILE_SIZE_X + prepadding + 3, w);
+                const int y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
+                const int y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding + 3, h);
 
-                    std::vector<ncnn::VkMat> bindings(3);
-                    bindings[0] = in_gpu;
-                    bindings[1] = in_tile_gpu;
-                    bindings[2] = in_alpha_tile_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(13);
-                    constants[0].i = in_gpu.w;
-                    constants[1].i = in_gpu.h;
-                    constants[2].i = in_gpu.cstep;
-                    constants[3].i = in_tile_gpu.w;
-                    constants[4].i = in_tile_gpu.h;
-                    constants[5].i = in_tile_gpu.cstep;
-                    constants[6].i = prepadding;
-                    constants[7].i = prepadding;
-                    constants[8].i = xi * TILE_SIZE_X;
-                    constants[9].i = std::min(yi * TILE_SIZE_Y, prepadding);
-                    constants[10].i = channels;
-                    constants[11].i = in_alpha_tile_gpu.w;
-                    constants[12].i = in_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = in_tile_gpu.w;
-                    dispatcher.h = in_tile_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
-                }
+                const float* const src[3] = { srcR, srcG, srcB };
+                const float* const anchor[3] = { reuse->anchorR, reuse->anchorG, reuse->anchorB };
 
-                // waifu2x
-                ncnn::VkMat out_tile_gpu;
+                if (tile_input_matches(src, anchor, srcStride, x0, x1, y0, y1, tile_reuse_threshold))
                 {
-                    ncnn::Extractor ex = net.create_extractor();
-
-                    ex.set_blob_vkallocator(blob_vkallocator);
-                    ex.set_workspace_vkallocator(blob_vkallocator);
-                    ex.set_staging_vkallocator(staging_vkallocator);
+                    record_tile_copy(cmd, reuse_from->out[tile_index], 0, out_gpu, tile_out_x, tile_out_w, out_gpu.h);
 
-                    ex.input("Input1", in_tile_gpu);
+                    if (stats)
+                    {
+                        stats->tiles++;
+                        stats->tiles_reused++;
+                    }
 
-                    ex.extract("Eltwise4", out_tile_gpu, cmd);
+                    continue;
                 }
+            }
+
+            const bool fast = hybrid && energy[xi] < hybrid_threshold;
 
-                ncnn::VkMat out_alpha_tile_gpu;
+            process_tile(cmd, in_gpu, out_gpu, xi, yi, pass_w, pass_h, crop_y, 0, out_gpu.h, download_opt, stats, fast);
 
-                // postproc
+            if (store)
+            {
+                ncnn::VkMat& tile = store->out[tile_index];
                 {
-                    std::vector<ncnn::VkMat> bindings(3);
-                    bindings[0] = out_tile_gpu;
-                    bindings[1] = out_alpha_tile_gpu;
-                    bindings[2] = out_gpu;
-
-                    std::vector<ncnn::vk_constant_type> constants(11);
-                    constants[0].i = out_tile_gpu.w;
-                    constants[1].i = out_tile_gpu.h;
-                    constants[2].i = out_tile_gpu.cstep;
-                    constants[3].i = out_gpu.w;
-                    constants[4].i = out_gpu.h;
-                    constants[5].i = out_gpu.cstep;
-                    constants[6].i = xi * TILE_SIZE_X * scale;
-                    constants[7].i = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    constants[8].i = channels;
-                    constants[9].i = out_alpha_tile_gpu.w;
-                    constants[10].i = out_alpha_tile_gpu.h;
-
-                    ncnn::VkMat dispatcher;
-                    dispatcher.w = std::min(TILE_SIZE_X * scale, out_gpu.w - xi * TILE_SIZE_X * scale);
-                    dispatcher.h = out_gpu.h;
-                    dispatcher.c = channels;
-
-                    cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
+                    ncnn::MutexLockGuard guard(tile_cache_lock);
+                    tile.create(tile_out_w, out_gpu.h, channels, (size_t)4u, 1, tile_cache_vkallocator);
                 }
+
+                record_tile_copy(cmd, out_gpu, tile_out_x, tile, 0, tile_out_w, out_gpu.h);
             }
 
             if (xtiles > 1)
@@ -435,23 +1153,874 @@ int Waifu2x::process(const float* srcR, const float* srcG, const float* srcB,
         {
             ncnn::Mat out;
 
-            cmd.record_clone(out_gpu, out, opt);
+            cmd.record_clone(out_gpu, out, download_opt);
 
             cmd.submit_and_wait();
+            cmd.reset();
 
-            const float* outR{ out.channel(0) };
-            const float* outG{ out.channel(1) };
-            const float* outB{ out.channel(2) };
-            for (auto y{ 0 }; y < out.h; y++) {
-                std::memcpy(dstR + (yi * scale * TILE_SIZE_Y + y) * dstStride, outR + y * out.w, out.w * sizeof(float));
-                std::memcpy(dstG + (yi * scale * TILE_SIZE_Y + y) * dstStride, outG + y * out.w, out.w * sizeof(float));
-                std::memcpy(dstB + (yi * scale * TILE_SIZE_Y + y) * dstStride, outB + y * out.w, out.w * sizeof(float));
+            const ptrdiff_t dst_offset = yi * model_scale * TILE_SIZE_Y * dstStride;
+            if (yi + 1 < ytiles)
+            {
+                copy_worker->submit(out, dstR + dst_offset, dstG + dst_offset, dstB + dst_offset, dstStride);
+            }
+            else
+            {
+                if (copy_worker)
+                    copy_worker->wait();
+
+                const float* outR{ out.channel(0) };
+                const float* outG{ out.channel(1) };
+                const float* outB{ out.channel(2) };
+                copy_plane(outR, out.w, dstR + dst_offset, dstStride, out.w, out.h, true);
+                copy_plane(outG, out.w, dstG + dst_offset, dstStride, out.w, out.h, true);
+                copy_plane(outB, out.w, dstB + dst_offset, dstStride, out.w, out.h, true);
             }
         }
     }
 
+    if (copy_worker)
+        copy_worker->wait();
+
+    // the allocators may go to another thread once reclaimed
+    out_gpu.release();
+    in_frame_gpu.release();
+
     vkdev->reclaim_blob_allocator(blob_vkallocator);
-    vkdev->reclaim_staging_allocator(staging_vkallocator);
+    upload_pool->reclaim(upload_vkallocator);
+    download_pool->reclaim(download_vkallocator);
+    if (mapped_upload_vkallocator)
+        mapped_upload_pool->reclaim(mapped_upload_vkallocator);
+    if (mapped_download_vkallocator)
+        mapped_download_pool->reclaim(mapped_download_vkallocator);
+
+    return 0;
+}
+
+int Waifu2x::process_cpu(const float* srcR, const float* srcG, const float* srcB,
+                         float* dstR, float* dstG, float* dstB,
+                         const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                         Waifu2xStats* stats) const
+{
+    constexpr int channels = 3;
+
+    const int model_scale = scale == 1 ? 1 : 2;
+    const int passes = scale == 8 ? 3 : scale == 4 ? 2 : 1;
+
+    // chained passes and resampling go through whole frames in host memory
+    ncnn::Mat frame;
+    const float* inR = srcR;
+    const float* inG = srcG;
+    const float* inB = srcB;
+    ptrdiff_t inStride = srcStride;
+
+    int pass_w = w;
+    int pass_h = h;
+
+    for (int pi = 0; pi < passes; pi++)
+    {
+        const bool last = pi == passes - 1 && !target_width;
+
+        ncnn::Mat out_frame;
+        if (last)
+        {
+            process_cpu_pass(inR, inG, inB, dstR, dstG, dstB, pass_w, pass_h, inStride, dstStride, stats);
+        }
+        else
+        {
+            out_frame.create(pass_w * model_scale, pass_h * model_scale, channels, (size_t)4u, 1);
+            process_cpu_pass(inR, inG, inB, out_frame.channel(0), out_frame.channel(1), out_frame.channel(2), pass_w, pass_h, inStride, out_frame.w, stats);
+
+            frame = out_frame;
+            inR = frame.channel(0);
+            inG = frame.channel(1);
+            inB = frame.channel(2);
+            inStride = frame.w;
+        }
+
+        pass_w *= model_scale;
+        pass_h *= model_scale;
+    }
+
+    // resample to the target size
+    if (target_width)
+    {
+        ncnn::Option resize_opt = net.opt;
+        resize_opt.use_fp16_packed = false;
+        resize_opt.use_fp16_storage = false;
+        resize_opt.use_fp16_arithmetic = false;
+
+        ncnn::Mat out;
+        bicubic_resize->forward(frame, out, resize_opt);
+
+        const float* outR{ out.channel(0) };
+        const float* outG{ out.channel(1) };
+        const float* outB{ out.channel(2) };
+        copy_plane(outR, out.w, dstR, dstStride, out.w, out.h, true);
+        copy_plane(outG, out.w, dstG, dstStride, out.w, out.h, true);
+        copy_plane(outB, out.w, dstB, dstStride, out.w, out.h, true);
+    }
 
     return 0;
 }
+
+int Waifu2x::process_cpu_pass(const float* srcR, const float* srcG, const float* srcB,
+                              float* dstR, float* dstG, float* dstB,
+                              const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                              Waifu2xStats* stats) const
+{
+    constexpr int channels = 3;
+
+    const int TILE_SIZE_X = tile_w;
+    const int TILE_SIZE_Y = tile_h;
+
+    const int model_scale = scale == 1 ? 1 : 2;
+
+    const float* src[channels] = { srcR, srcG, srcB };
+    float* dst[channels] = { dstR, dstG, dstB };
+
+    const int xtiles = (w + TILE_SIZE_X - 1) / TILE_SIZE_X;
+    const int ytiles = (h + TILE_SIZE_Y - 1) / TILE_SIZE_Y;
+
+    const HostKernels& kernels = host_kernels();
+
+    // tiles run concurrently with one extractor each
+    // ncnn layers inside the tile loop would open nested parallel regions, which openmp serializes by default,
+    // so ncnn only gets the threads when the frame is a single tile and the loop runs on one thread
+    const int num_threads = net.opt.num_threads;
+    const int workers = std::min(num_threads, xtiles * ytiles);
+    const int tile_threads = workers == 1 ? num_threads : 1;
+
+    int tiles = 0;
+    int tiles_flat = 0;
+    int tiles_fast = 0;
+
+    #pragma omp parallel for schedule(dynamic) num_threads(workers) reduction(+: tiles, tiles_flat, tiles_fast)
+    for (int i = 0; i < xtiles * ytiles; i++)
+    {
+        const int yi = i / xtiles;
+        const int xi = i % xtiles;
+
+        const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
+
+        int prepadding_bottom = 0;
+        if (model_scale == 1)
+        {
+            prepadding_bottom += (tile_h_nopad + 3) / 4 * 4 - tile_h_nopad;
+        }
+        if (model_scale == 2)
+        {
+            prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
+        }
+
+        const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+
+        int prepadding_right = 0;
+        if (model_scale == 1)
+        {
+            prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
+        }
+        if (model_scale == 2)
+        {
+            prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
+        }
+
+        const int out_tile_x0 = xi * TILE_SIZE_X * model_scale;
+        const int out_tile_y0 = yi * TILE_SIZE_Y * model_scale;
+        const int out_tile_w = tile_w_nopad * model_scale;
+        const int out_tile_h = tile_h_nopad * model_scale;
+
+        tiles++;
+
+        // flat tiles and the detail metric, over the input the model with the larger context sees
+        bool flat = false;
+        bool fast = false;
+        float flat_values[channels];
+        if (flat_skip || hybrid)
+        {
+            const int x0 = std::max(xi * TILE_SIZE_X - prepadding, 0);
+            const int x1 = std::min((xi + 1) * TILE_SIZE_X + prepadding + prepadding_right, w);
+            const int y0 = std::max(yi * TILE_SIZE_Y - prepadding, 0);
+            const int y1 = std::min((yi + 1) * TILE_SIZE_Y + prepadding + prepadding_bottom, h);
+
+            flat = flat_skip;
+            float energy = 0.f;
+
+            for (int q = 0; q < channels; q++)
+            {
+                float vmin = 1.f;
+                float vmax = 0.f;
+                float sum = 0.f;
+                for (int y = y0; y < y1; y++)
+                {
+                    const float* ptr = src[q] + y * srcStride;
+                    const float* ptr_below = y + 1 < h ? ptr + srcStride : ptr;
+                    kernels.tile_stats_row(ptr, ptr_below, x0, x1, vmin, vmax, sum);
+                }
+
+                if (vmax - vmin > flat_threshold)
+                    flat = false;
+
+                flat_values[q] = (vmin + vmax) * 0.5f;
+                energy += sum / ((float)(x1 - x0) * (y1 - y0) * channels);
+            }
+
+            fast = hybrid && energy < hybrid_threshold;
+        }
+
+        const float clip_eps = 0.5f / 255.f;
+
+        if (flat)
+        {
+            for (int q = 0; q < channels; q++)
+            {
+                for (int y = 0; y < out_tile_h; y++)
+                {
+                    float* outptr = dst[q] + (out_tile_y0 + y) * dstStride + out_tile_x0;
+                    std::fill(outptr, outptr + out_tile_w, flat_values[q] + clip_eps);
+                }
+            }
+
+            tiles_flat++;
+
+            continue;
+        }
+
+        if (fast)
+            tiles_fast++;
+
+        // hybrid mode runs smooth tiles through the faster network, which sees less context
+        const ncnn::Net& tile_net = fast ? net_fast : net;
+        const Upconv7* tile_engine = fast ? upconv7_fast : upconv7;
+        const int tile_prepadding = fast ? prepadding_fast : prepadding;
+
+        // crop tile
+        const int tile_x0 = xi * TILE_SIZE_X - tile_prepadding;
+        const int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + tile_prepadding + prepadding_right;
+        const int tile_y0 = yi * TILE_SIZE_Y - tile_prepadding;
+        const int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + tile_prepadding + prepadding_bottom;
+
+        const int in_tile_w = tile_x1 - tile_x0;
+        const int in_tile_h = tile_y1 - tile_y0;
+
+        const int tta_count = tta_mode ? tta_mode : 1;
+
+        // preproc, edges replicated and values clamped like the preproc shaders
+        ncnn::Mat in_tile[8];
+        for (int ti = 0; ti < tta_count; ti++)
+        {
+            if (ti < 4)
+                in_tile[ti].create(in_tile_w, in_tile_h, channels, (size_t)4u, 1);
+            else
+                in_tile[ti].create(in_tile_h, in_tile_w, channels, (size_t)4u, 1);
+        }
+
+        // rows of the identity orientation, written into the others at the step tta_offset moves by along x
+        for (int q = 0; q < channels; q++)
+        {
+            for (int y = 0; y < in_tile_h; y++)
+            {
+                const float* ptr = src[q] + std::clamp(tile_y0 + y, 0, h - 1) * srcStride;
+                float* row = (float*)in_tile[0].channel(q) + y * in_tile_w;
+                kernels.preproc_row(ptr, tile_x0, in_tile_w, w, row);
+
+                for (int ti = 1; ti < tta_count; ti++)
+                {
+                    const int offset = tta_offset(ti, 0, y, in_tile_w, in_tile_h);
+                    const ptrdiff_t step = tta_offset(ti, 1, y, in_tile_w, in_tile_h) - offset;
+                    kernels.scatter_row(row, in_tile_w, (float*)in_tile[ti].channel(q) + offset, step);
+                }
+            }
+        }
+
+        // waifu2x
+        ncnn::Mat out_tile[8];
+        for (int ti = 0; ti < tta_count; ti++)
+        {
+            if (tile_engine)
+            {
+                tile_engine->forward(in_tile[ti], out_tile[ti]);
+                continue;
+            }
+
+            ncnn::Extractor ex = tile_net.create_extractor();
+
+            ex.set_num_threads(tile_threads);
+
+            ex.input("Input1", in_tile[ti]);
+
+            ex.extract("Eltwise4", out_tile[ti]);
+        }
+
+        // postproc, orientations averaged back
+        const int out_w = out_tile[0].w;
+        const int out_h = out_tile[0].h;
+        const float norm = 1.f / tta_count;
+
+        for (int q = 0; q < channels; q++)
+        {
+            for (int y = 0; y < out_tile_h; y++)
+            {
+                float* outptr = dst[q] + (out_tile_y0 + y) * dstStride + out_tile_x0;
+                std::fill(outptr, outptr + out_tile_w, 0.f);
+
+                for (int ti = 0; ti < tta_count; ti++)
+                {
+                    const int offset = tta_offset(ti, 0, y, out_w, out_h);
+                    const ptrdiff_t step = tta_offset(ti, 1, y, out_w, out_h) - offset;
+                    kernels.accumulate_row((const float*)out_tile[ti].channel(q) + offset, step, out_tile_w, outptr);
+                }
+
+                kernels.scale_row(outptr, out_tile_w, norm, clip_eps);
+            }
+        }
+    }
+
+    if (stats)
+    {
+        stats->tiles += tiles;
+        stats->tiles_flat += tiles_flat;
+        stats->tiles_fast += tiles_fast;
+    }
+
+    return 0;
+}
+
+int Waifu2x::process_tile(ncnn::VkCompute& cmd, const ncnn::VkMat& in_gpu, ncnn::VkMat& out_gpu,
+                          const int xi, const int yi, const int w, const int h,
+                          const int crop_y, const int out_offset, const int out_h,
+                          const ncnn::Option& opt, Waifu2xStats* stats, const bool fast) const
+{
+    constexpr int channels = 3;
+
+    const int TILE_SIZE_X = tile_w;
+    const int TILE_SIZE_Y = tile_h;
+
+    const int model_scale = scale == 1 ? 1 : 2;
+
+    ncnn::VkAllocator* blob_vkallocator = opt.blob_vkallocator;
+    ncnn::VkAllocator* staging_vkallocator = opt.staging_vkallocator;
+
+    // hybrid mode runs smooth tiles through the faster network, which sees less context
+    const ncnn::Net& tile_net = fast ? net_fast : net;
+    const int tile_prepadding = fast ? prepadding_fast : prepadding;
+
+    const size_t in_out_tile_elemsize = opt.use_fp16_storage ? 2u : 4u;
+
+    const int tile_h_nopad = std::min((yi + 1) * TILE_SIZE_Y, h) - yi * TILE_SIZE_Y;
+
+    int prepadding_bottom = tile_prepadding;
+    if (model_scale == 1)
+    {
+        prepadding_bottom += (tile_h_nopad + 3) / 4 * 4 - tile_h_nopad;
+    }
+    if (model_scale == 2)
+    {
+        prepadding_bottom += (tile_h_nopad + 1) / 2 * 2 - tile_h_nopad;
+    }
+
+    if (stats)
+    {
+        stats->tiles++;
+
+        if (fast)
+            stats->tiles_fast++;
+    }
+
+    const int tile_w_nopad = std::min((xi + 1) * TILE_SIZE_X, w) - xi * TILE_SIZE_X;
+
+    int prepadding_right = tile_prepadding;
+    if (model_scale == 1)
+    {
+        prepadding_right += (tile_w_nopad + 3) / 4 * 4 - tile_w_nopad;
+    }
+    if (model_scale == 2)
+    {
+        prepadding_right += (tile_w_nopad + 1) / 2 * 2 - tile_w_nopad;
+    }
+
+    if (tta_mode && tta_stream)
+    {
+        // crop tile
+        int tile_x0 = xi * TILE_SIZE_X - tile_prepadding;
+        int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
+        int tile_y0 = yi * TILE_SIZE_Y - tile_prepadding;
+        int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
+
+        // adaptive mode stops after the first two orientations if they agree
+        int tta_count = tta_mode;
+
+        // one orientation at a time, accumulated into out_gpu
+        for (int ti = 0; ti < tta_count; ti++)
+        {
+            // preproc
+            ncnn::VkMat in_tile_gpu;
+            ncnn::VkMat in_alpha_tile_gpu;
+            {
+                if (ti < 4)
+                    in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                else
+                    in_tile_gpu.create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+
+                std::vector<ncnn::VkMat> bindings(3);
+                bindings[0] = in_gpu;
+                bindings[1] = in_tile_gpu;
+                bindings[2] = in_alpha_tile_gpu;
+
+                std::vector<ncnn::vk_constant_type> constants(14);
+                constants[0].i = in_gpu.w;
+                constants[1].i = in_gpu.h;
+                constants[2].i = in_gpu.cstep;
+                constants[3].i = tile_x1 - tile_x0;
+                constants[4].i = tile_y1 - tile_y0;
+                constants[5].i = in_tile_gpu.cstep;
+                constants[6].i = tile_prepadding;
+                constants[7].i = tile_prepadding;
+                constants[8].i = xi * TILE_SIZE_X;
+                constants[9].i = crop_y;
+                constants[10].i = channels;
+                constants[11].i = in_alpha_tile_gpu.w;
+                constants[12].i = in_alpha_tile_gpu.h;
+                constants[13].i = ti;
+
+                ncnn::VkMat dispatcher;
+                dispatcher.w = tile_x1 - tile_x0;
+                dispatcher.h = tile_y1 - tile_y0;
+                dispatcher.c = channels;
+
+                cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
+            }
+
+            // waifu2x
+            ncnn::VkMat out_tile_gpu;
+            {
+                ncnn::Extractor ex = tile_net.create_extractor();
+
+                ex.set_blob_vkallocator(blob_vkallocator);
+                ex.set_workspace_vkallocator(blob_vkallocator);
+                ex.set_staging_vkallocator(staging_vkallocator);
+
+                ex.input("Input1", in_tile_gpu);
+
+                ex.extract("Eltwise4", out_tile_gpu, cmd);
+            }
+
+            // adaptive, compare the flipped orientation against the identity one in out_gpu
+            if (tta_threshold > 0.f && ti == 1)
+            {
+                const int gx_max = std::min(TILE_SIZE_X * model_scale, out_gpu.w - xi * TILE_SIZE_X * model_scale);
+
+                ncnn::VkMat diff_gpu;
+                diff_gpu.create(out_h * channels, (size_t)4u, 1, blob_vkallocator);
+
+                std::vector<ncnn::VkMat> bindings(3);
+                bindings[0] = out_tile_gpu;
+                bindings[1] = out_gpu;
+                bindings[2] = diff_gpu;
+
+                std::vector<ncnn::vk_constant_type> constants(9);
+                constants[0].i = out_tile_gpu.w;
+                constants[1].i = out_tile_gpu.h;
+                constants[2].i = out_tile_gpu.cstep;
+                constants[3].i = out_gpu.w;
+                constants[4].i = out_h;
+                constants[5].i = out_gpu.cstep;
+                constants[6].i = out_offset + xi * TILE_SIZE_X * model_scale;
+                constants[7].i = gx_max;
+                constants[8].i = channels;
+
+                ncnn::VkMat dispatcher;
+                dispatcher.w = out_h;
+                dispatcher.h = channels;
+                dispatcher.c = 1;
+
+                cmd.record_pipeline(waifu2x_tta_diff, bindings, constants, dispatcher);
+
+                ncnn::Mat diff;
+                cmd.record_clone(diff_gpu, diff, opt);
+
+                cmd.submit_and_wait();
+                cmd.reset();
+
+                const float* diff_data = diff;
+
+                double sum = 0.0;
+                for (int i = 0; i < out_h * channels; i++)
+                    sum += diff_data[i];
+
+                if (sum / ((double)gx_max * out_h * channels) > tta_threshold)
+                {
+                    if (stats)
+                        stats->tta_escalated++;
+                }
+                else
+                {
+                    tta_count = 2;
+                }
+            }
+
+            ncnn::VkMat out_alpha_tile_gpu;
+
+            // postproc
+            {
+                std::vector<ncnn::VkMat> bindings(3);
+                bindings[0] = out_tile_gpu;
+                bindings[1] = out_alpha_tile_gpu;
+                bindings[2] = out_gpu;
+
+                std::vector<ncnn::vk_constant_type> constants(14);
+                constants[0].i = ti < 4 ? out_tile_gpu.w : out_tile_gpu.h;
+                constants[1].i = ti < 4 ? out_tile_gpu.h : out_tile_gpu.w;
+                constants[2].i = out_tile_gpu.cstep;
+                constants[3].i = out_gpu.w;
+                constants[4].i = out_h;
+                constants[5].i = out_gpu.cstep;
+                constants[6].i = out_offset + xi * TILE_SIZE_X * model_scale;
+                constants[7].i = std::min(TILE_SIZE_X * model_scale, out_gpu.w - xi * TILE_SIZE_X * model_scale);
+                constants[8].i = channels;
+                constants[9].i = out_alpha_tile_gpu.w;
+                constants[10].i = out_alpha_tile_gpu.h;
+                constants[11].i = ti;
+                constants[12].i = ti == 0 ? 0 : 1;
+                constants[13].f = ti == tta_count - 1 ? 1.f / tta_count : 0.f;
+
+                ncnn::VkMat dispatcher;
+                dispatcher.w = std::min(TILE_SIZE_X * model_scale, out_gpu.w - xi * TILE_SIZE_X * model_scale);
+                dispatcher.h = out_h;
+                dispatcher.c = channels;
+
+                cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
+            }
+        }
+    }
+    else if (tta_mode)
+    {
+        // preproc
+        ncnn::VkMat in_tile_gpu[8];
+        ncnn::VkMat in_alpha_tile_gpu;
+        {
+            // crop tile
+            int tile_x0 = xi * TILE_SIZE_X - tile_prepadding;
+            int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
+            int tile_y0 = yi * TILE_SIZE_Y - tile_prepadding;
+            int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
+
+            for (int ti = 0; ti < tta_mode; ti++)
+            {
+                if (ti < 4)
+                    in_tile_gpu[ti].create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+                else
+                    in_tile_gpu[ti].create(tile_y1 - tile_y0, tile_x1 - tile_x0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+            }
+
+            std::vector<ncnn::VkMat> bindings(tta_mode + 2);
+            bindings[0] = in_gpu;
+            for (int ti = 0; ti < tta_mode; ti++)
+                bindings[ti + 1] = in_tile_gpu[ti];
+            bindings[tta_mode + 1] = in_alpha_tile_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(13);
+            constants[0].i = in_gpu.w;
+            constants[1].i = in_gpu.h;
+            constants[2].i = in_gpu.cstep;
+            constants[3].i = in_tile_gpu[0].w;
+            constants[4].i = in_tile_gpu[0].h;
+            constants[5].i = in_tile_gpu[0].cstep;
+            constants[6].i = tile_prepadding;
+            constants[7].i = tile_prepadding;
+            constants[8].i = xi * TILE_SIZE_X;
+            constants[9].i = crop_y;
+            constants[10].i = channels;
+            constants[11].i = in_alpha_tile_gpu.w;
+            constants[12].i = in_alpha_tile_gpu.h;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = in_tile_gpu[0].w;
+            dispatcher.h = in_tile_gpu[0].h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
+        }
+
+        // waifu2x
+        ncnn::VkMat out_tile_gpu[8];
+        for (int ti = 0; ti < tta_mode; ti++)
+        {
+            ncnn::Extractor ex = tile_net.create_extractor();
+
+            ex.set_blob_vkallocator(blob_vkallocator);
+            ex.set_workspace_vkallocator(blob_vkallocator);
+            ex.set_staging_vkallocator(staging_vkallocator);
+
+            ex.input("Input1", in_tile_gpu[ti]);
+
+            ex.extract("Eltwise4", out_tile_gpu[ti], cmd);
+        }
+
+        ncnn::VkMat out_alpha_tile_gpu;
+
+        // postproc
+        {
+            std::vector<ncnn::VkMat> bindings(tta_mode + 2);
+            for (int ti = 0; ti < tta_mode; ti++)
+                bindings[ti] = out_tile_gpu[ti];
+            bindings[tta_mode] = out_alpha_tile_gpu;
+            bindings[tta_mode + 1] = out_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(11);
+            constants[0].i = out_tile_gpu[0].w;
+            constants[1].i = out_tile_gpu[0].h;
+            constants[2].i = out_tile_gpu[0].cstep;
+            constants[3].i = out_gpu.w;
+            constants[4].i = out_h;
+            constants[5].i = out_gpu.cstep;
+            constants[6].i = out_offset + xi * TILE_SIZE_X * model_scale;
+            constants[7].i = std::min(TILE_SIZE_X * model_scale, out_gpu.w - xi * TILE_SIZE_X * model_scale);
+            constants[8].i = channels;
+            constants[9].i = out_alpha_tile_gpu.w;
+            constants[10].i = out_alpha_tile_gpu.h;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = std::min(TILE_SIZE_X * model_scale, out_gpu.w - xi * TILE_SIZE_X * model_scale);
+            dispatcher.h = out_h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
+        }
+    }
+    else
+    {
+        // preproc
+        ncnn::VkMat in_tile_gpu;
+        ncnn::VkMat in_alpha_tile_gpu;
+        {
+            // crop tile
+            int tile_x0 = xi * TILE_SIZE_X - tile_prepadding;
+            int tile_x1 = std::min((xi + 1) * TILE_SIZE_X, w) + prepadding_right;
+            int tile_y0 = yi * TILE_SIZE_Y - tile_prepadding;
+            int tile_y1 = std::min((yi + 1) * TILE_SIZE_Y, h) + prepadding_bottom;
+
+            in_tile_gpu.create(tile_x1 - tile_x0, tile_y1 - tile_y0, 3, in_out_tile_elemsize, 1, blob_vkallocator);
+
+            std::vector<ncnn::VkMat> bindings(3);
+            bindings[0] = in_gpu;
+            bindings[1] = in_tile_gpu;
+            bindings[2] = in_alpha_tile_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(13);
+            constants[0].i = in_gpu.w;
+            constants[1].i = in_gpu.h;
+            constants[2].i = in_gpu.cstep;
+            constants[3].i = in_tile_gpu.w;
+            constants[4].i = in_tile_gpu.h;
+            constants[5].i = in_tile_gpu.cstep;
+            constants[6].i = tile_prepadding;
+            constants[7].i = tile_prepadding;
+            constants[8].i = xi * TILE_SIZE_X;
+            constants[9].i = crop_y;
+            constants[10].i = channels;
+            constants[11].i = in_alpha_tile_gpu.w;
+            constants[12].i = in_alpha_tile_gpu.h;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = in_tile_gpu.w;
+            dispatcher.h = in_tile_gpu.h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(waifu2x_preproc, bindings, constants, dispatcher);
+        }
+
+        // waifu2x
+        ncnn::VkMat out_tile_gpu;
+        {
+            ncnn::Extractor ex = tile_net.create_extractor();
+
+            ex.set_blob_vkallocator(blob_vkallocator);
+            ex.set_workspace_vkallocator(blob_vkallocator);
+            ex.set_staging_vkallocator(staging_vkallocator);
+
+            ex.input("Input1", in_tile_gpu);
+
+            ex.extract("Eltwise4", out_tile_gpu, cmd);
+        }
+
+        ncnn::VkMat out_alpha_tile_gpu;
+
+        // postproc
+        {
+            std::vector<ncnn::VkMat> bindings(3);
+            bindings[0] = out_tile_gpu;
+            bindings[1] = out_alpha_tile_gpu;
+            bindings[2] = out_gpu;
+
+            std::vector<ncnn::vk_constant_type> constants(11);
+            constants[0].i = out_tile_gpu.w;
+            constants[1].i = out_tile_gpu.h;
+            constants[2].i = out_tile_gpu.cstep;
+            constants[3].i = out_gpu.w;
+            constants[4].i = out_h;
+            constants[5].i = out_gpu.cstep;
+            constants[6].i = out_offset + xi * TILE_SIZE_X * model_scale;
+            constants[7].i = std::min(TILE_SIZE_X * model_scale, out_gpu.w - xi * TILE_SIZE_X * model_scale);
+            constants[8].i = channels;
+            constants[9].i = out_alpha_tile_gpu.w;
+            constants[10].i = out_alpha_tile_gpu.h;
+
+            ncnn::VkMat dispatcher;
+            dispatcher.w = std::min(TILE_SIZE_X * model_scale, out_gpu.w - xi * TILE_SIZE_X * model_scale);
+            dispatcher.h = out_h;
+            dispatcher.c = channels;
+
+            cmd.record_pipeline(waifu2x_postproc, bindings, constants, dispatcher);
+        }
+    }
+
+    return 0;
+}
+
+bool Waifu2x::record_upload(ncnn::VkCompute& cmd, const ncnn::Mat& in, ncnn::VkMat& in_gpu, const ncnn::Option& opt) const
+{
+    if (!transfer_queue)
+    {
+        cmd.record_clone(in, in_gpu, opt);
+        return true;
+    }
+
+    // the preproc shader reads fp32 in the shape of the frame
+    ncnn::Option upload_opt = opt;
+    upload_opt.use_fp16_packed = false;
+    upload_opt.use_fp16_storage = false;
+
+    // ncnn hands the queue family ownership to the compute queue inside submit_and_wait,
+    // which blocks until the copy is done, there is no way to make a compute submission wait on it instead
+    ncnn::VkTransfer transfer(vkdev);
+    transfer.record_upload(in, in_gpu, upload_opt, false);
+    transfer.submit_and_wait();
+
+    return false;
+}
+
+void Waifu2x::record_tile_copy(ncnn::VkCompute& cmd, const ncnn::VkMat& src, const int src_offset, const ncnn::VkMat& dst, const int dst_offset,
+                               const int w, const int h) const
+{
+    std::vector<ncnn::VkMat> bindings(2);
+    bindings[0] = src;
+    bindings[1] = dst;
+
+    std::vector<ncnn::vk_constant_type> constants(9);
+    constants[0].i = w;
+    constants[1].i = h;
+    constants[2].i = dst.c;
+    constants[3].i = src.w;
+    constants[4].i = src.cstep;
+    constants[5].i = src_offset;
+    constants[6].i = dst.w;
+    constants[7].i = dst.cstep;
+    constants[8].i = dst_offset;
+
+    ncnn::VkMat dispatcher;
+    dispatcher.w = w;
+    dispatcher.h = h;
+    dispatcher.c = dst.c;
+
+    cmd.record_pipeline(waifu2x_tile_copy, bindings, constants, dispatcher);
+}
+
+void Waifu2x::analyze_tiles(ncnn::VkCompute& cmd, const ncnn::VkMat& in_gpu, const int crop_y, const int rows, const int xtiles,
+                            const ncnn::Option& opt, std::vector<unsigned char>& flat, std::vector<float>& values, std::vector<float>& energy) const
+{
+    constexpr int channels = 3;
+
+    // input rows seen by the tiles of this row, the alignment padding is at most 3 more
+    const int y0 = std::max(crop_y - prepadding, 0);
+    const int y1 = std::min(crop_y + rows + prepadding + 3, in_gpu.h);
+
+    ncnn::VkMat stats_gpu;
+    stats_gpu.create(xtiles * (y1 - y0) * channels * 3, (size_t)4u, 1, opt.blob_vkallocator);
+
+    {
+        std::vector<ncnn::VkMat> bindings(2);
+        bindings[0] = in_gpu;
+        bindings[1] = stats_gpu;
+
+        std::vector<ncnn::vk_constant_type> constants(10);
+        constants[0].i = in_gpu.w;
+        constants[1].i = in_gpu.h;
+        constants[2].i = in_gpu.cstep;
+        constants[3].i = tile_w;
+        constants[4].i = prepadding;
+        constants[5].i = prepadding + 3;
+        constants[6].i = y0;
+        constants[7].i = y1 - y0;
+        constants[8].i = xtiles;
+        constants[9].i = channels;
+
+        ncnn::VkMat dispatcher;
+        dispatcher.w = xtiles;
+        dispatcher.h = y1 - y0;
+        dispatcher.c = channels;
+
+        cmd.record_pipeline(waifu2x_tile_stats, bindings, constants, dispatcher);
+    }
+
+    ncnn::Mat stats;
+    cmd.record_clone(stats_gpu, stats, opt);
+
+    cmd.submit_and_wait();
+    cmd.reset();
+
+    const float* stats_data = stats;
+
+    flat.assign(xtiles, flat_skip ? 1 : 0);
+    values.resize(xtiles * channels);
+    energy.assign(xtiles, 0.f);
+
+    for (int q = 0; q < channels; q++)
+    {
+        for (int xi = 0; xi < xtiles; xi++)
+        {
+            float vmin = 1.f;
+            float vmax = 0.f;
+            float sum = 0.f;
+            for (int y = 0; y < y1 - y0; y++)
+            {
+                const float* ptr = stats_data + ((q * (y1 - y0) + y) * xtiles + xi) * 3;
+                vmin = std::min(vmin, ptr[0]);
+                vmax = std::max(vmax, ptr[1]);
+                sum += ptr[2];
+            }
+
+            if (vmax - vmin > flat_threshold)
+                flat[xi] = 0;
+
+            values[xi * channels + q] = (vmin + vmax) * 0.5f;
+
+            // mean absolute gradient per sample
+            energy[xi] += sum / ((y1 - y0) * channels);
+        }
+    }
+}
+
+void Waifu2x::record_tile_fill(ncnn::VkCompute& cmd, const ncnn::VkMat& dst, const int dst_offset, const int w, const int h,
+                               const float* values) const
+{
+    std::vector<ncnn::VkMat> bindings(1);
+    bindings[0] = dst;
+
+    std::vector<ncnn::vk_constant_type> constants(9);
+    constants[0].i = w;
+    constants[1].i = h;
+    constants[2].i = dst.c;
+    constants[3].i = dst.w;
+    constants[4].i = dst.cstep;
+    constants[5].i = dst_offset;
+    constants[6].f = values[0];
+    constants[7].f = values[1];
+    constants[8].f = values[2];
+
+    ncnn::VkMat dispatcher;
+    dispatcher.w = w;
+    dispatcher.h = h;
+    dispatcher.c = dst.c;
+
+    cmd.record_pipeline(waifu2x_tile_fill, bindings, constants, dispatcher);
+}
@@ -3,28 +3,98 @@
 #ifndef WAIFU2X_H
 #define WAIFU2X_H
 
+#include <memory>
 #include <string>
+#include <vector>
 
 // ncnn
 #include "net.h"
 #include "gpu.h"
 #include "layer.h"
 
+#include "upconv7.h"
+
+// per-frame counters filled in by Waifu2x::process
+struct Waifu2xStats
+{
+    int tiles = 0;
+    int tta_escalated = 0;
+    int tiles_reused = 0;
+    int tiles_flat = 0;
+    int tiles_fast = 0;
+};
+
+// temporal tile reuse, where the source passed to Waifu2x::process sits in its group of frames
+// tiles are only reused from the first frame of the group, so the output does not depend on which frames were upscaled before
+struct Waifu2xReuse
+{
+    int frame;
+    int anchor;
+    // the first frame of the group, at the same position and stride as the source
+    const float* anchorR;
+    const float* anchorG;
+    const float* anchorB;
+    // position of the source in the frame, tiles of differently cropped sources do not line up
+    int x;
+    int y;
+};
+
+// memory type for staging and blob buffers with required and preferred property flags
+uint32_t find_buffer_memory_type(const ncnn::VulkanDevice* vkdev, VkFlags required, VkFlags preferred, VkFlags preferred_not);
+
+// allocators on a memory type picked up front instead of ncnn's default,
+// handed out per process call like the device's own pools since ncnn allocators are not thread safe
+class Waifu2xAllocatorPool
+{
+public:
+    Waifu2xAllocatorPool(const ncnn::VulkanDevice* vkdev, const uint32_t memory_type_index, const bool staging);
+    ~Waifu2xAllocatorPool();
+
+    ncnn::VkAllocator* acquire();
+    void reclaim(ncnn::VkAllocator* allocator);
+
+public:
+    const uint32_t memory_type_index;
+
+private:
+    const ncnn::VulkanDevice* vkdev;
+    const bool staging;
+    ncnn::Mutex lock;
+    std::vector<ncnn::VkAllocator*> allocators;
+    std::vector<ncnn::VkAllocator*> idle;
+};
+
 class Waifu2x
 {
 public:
-    Waifu2x(int gpuid, bool tta_mode = false, int num_threads = 1);
+    Waifu2x(int gpuid, int tta_mode = 0, int num_threads = 1, bool tta_stream = false);
     ~Waifu2x();
 
 #if _WIN32
     int load(const std::wstring& parampath, const std::wstring& modelpath, const bool fp32);
+
+    // the faster network for smooth tiles in hybrid mode, after load
+    int load_fast(const std::wstring& parampath, const std::wstring& modelpath);
 #else
     int load(const std::string& parampath, const std::string& modelpath, const bool fp32);
+
+    // the faster network for smooth tiles in hybrid mode, after load
+    int load_fast(const std::string& parampath, const std::string& modelpath);
 #endif
 
     int process(const float* srcR, const float* srcG, const float* srcB,
                 float* dstR, float* dstG, float* dstB,
-                const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride) const;
+                const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                Waifu2xStats* stats = 0, const Waifu2xReuse* reuse = 0) const;
+
+    // memory type indices frames are uploaded and read back through, -1 without a gpu
+    // device memory types when the host can map them, the staging buffers otherwise
+    uint32_t upload_memory_type() const;
+    uint32_t download_memory_type() const;
+
+    // rough peak of device memory the network takes for one tile, and the largest device local heap, after load
+    size_t tile_memory() const;
+    size_t device_memory() const;
 
 public:
     // waifu2x parameters
@@ -33,14 +103,103 @@ public:
     int tile_w;
     int tile_h;
     int prepadding;
+    float tta_threshold;
+    int target_width;
+    int target_height;
+    bool tile_reuse;
+    float tile_reuse_threshold;
+    bool flat_skip;
+    float flat_threshold;
+    bool hybrid;
+    float hybrid_threshold;
+    int prepadding_fast;
+    // fixed convolution kernels for bitwise reproducible output, before load
+    bool deterministic;
+
+private:
+    // temporal tile reuse, the upscaled tiles of one anchor frame at one size and position
+    struct AnchorTiles
+    {
+        int frame;
+        int x;
+        int y;
+        int w;
+        int h;
+        bool done;
+        // empty where the anchor tile was flat
+        std::vector<ncnn::VkMat> out;
+    };
+
+    // tiles matching the anchor within tile_reuse_threshold are copied from reuse_from, computed tiles are kept in store
+    int process_gpu(const float* srcR, const float* srcG, const float* srcB,
+                    float* dstR, float* dstG, float* dstB,
+                    const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                    Waifu2xStats* stats, const Waifu2xReuse* reuse, const AnchorTiles* reuse_from, AnchorTiles* store) const;
+
+    // host path for gpuid == -1
+    int process_cpu(const float* srcR, const float* srcG, const float* srcB,
+                    float* dstR, float* dstG, float* dstB,
+                    const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                    Waifu2xStats* stats) const;
+
+    // one 1x or 2x pass over the whole frame, tile by tile
+    int process_cpu_pass(const float* srcR, const float* srcG, const float* srcB,
+                         float* dstR, float* dstG, float* dstB,
+                         const int w, const int h, const ptrdiff_t srcStride, const ptrdiff_t dstStride,
+                         Waifu2xStats* stats) const;
+
+    // opt stages readback here and in analyze_tiles
+    int process_tile(ncnn::VkCompute& cmd, const ncnn::VkMat& in_gpu, ncnn::VkMat& out_gpu,
+                     const int xi, const int yi, const int w, const int h,
+                     const int crop_y, const int out_offset, const int out_h,
+                     const ncnn::Option& opt, Waifu2xStats* stats, const bool fast = false) const;
+
+    // uploads go through the transfer queue when the device has a separate one, waited for before returning
+    // returns whether the copy was recorded into cmd instead, which then still has to be submitted
+    bool record_upload(ncnn::VkCompute& cmd, const ncnn::Mat& in, ncnn::VkMat& in_gpu, const ncnn::Option& opt) const;
+
+    void record_tile_copy(ncnn::VkCompute& cmd, const ncnn::VkMat& src, const int src_offset, const ncnn::VkMat& dst, const int dst_offset,
+                          const int w, const int h) const;
+
+    // per tile of a row, whether its input is flat within flat_threshold, the value to fill it with and its gradient energy
+    void analyze_tiles(ncnn::VkCompute& cmd, const ncnn::VkMat& in_gpu, const int crop_y, const int rows, const int xtiles,
+                       const ncnn::Option& opt, std::vector<unsigned char>& flat, std::vector<float>& values, std::vector<float>& energy) const;
+
+    void record_tile_fill(ncnn::VkCompute& cmd, const ncnn::VkMat& dst, const int dst_offset, const int w, const int h,
+                          const float* values) const;
 
 private:
     ncnn::VulkanDevice* vkdev;
     ncnn::Net net;
+    ncnn::Net net_fast;
+    // fused host engines replacing net and net_fast for the upconv_7 models when there is no gpu
+    Upconv7* upconv7;
+    Upconv7* upconv7_fast;
     ncnn::Pipeline* waifu2x_preproc;
     ncnn::Pipeline* waifu2x_postproc;
+    ncnn::Pipeline* waifu2x_tta_diff;
+    ncnn::Pipeline* waifu2x_tile_copy;
+    ncnn::Pipeline* waifu2x_tile_stats;
+    ncnn::Pipeline* waifu2x_tile_fill;
     ncnn::Layer* bicubic_2x;
-    bool tta_mode;
+    ncnn::Layer* bicubic_resize;
+    int tta_mode;
+    bool tta_stream;
+
+    ncnn::VkAllocator* tile_cache_vkallocator;
+
+    Waifu2xAllocatorPool* upload_pool;
+    Waifu2xAllocatorPool* download_pool;
+
+    // host visible device memory, 0 unless the gpu has unified memory or a large bar
+    Waifu2xAllocatorPool* mapped_upload_pool;
+    Waifu2xAllocatorPool* mapped_download_pool;
+    bool transfer_queue;
+
+    // the anchors of the current and the previous group, for frames of the last group still in flight
+    mutable ncnn::Mutex tile_cache_lock;
+    mutable ncnn::ConditionVariable tile_cache_done;
+    mutable std::vector<std::shared_ptr<AnchorTiles> > tile_cache;
 };
 
 #endif // WAIFU2X_H
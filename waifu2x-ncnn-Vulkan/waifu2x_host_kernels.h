@@ -0,0 +1,97 @@
+// row loops of the host path of waifu2x
+// no include guard, waifu2x.cpp includes this once per instruction set inside its own namespace
+
+// smallest and largest value of a row of a tile and the sum of its gradients to the right and below, values clamped to 0..1
+// vmin and vmax are updated, the gradients added to sum
+static void tile_stats_row(const float* ptr, const float* ptr_below, const int x0, const int x1, float& vmin, float& vmax, float& sum)
+{
+    float row_min = vmin;
+    float row_max = vmax;
+    float row_sum = 0.f;
+
+    #pragma omp simd reduction(min: row_min) reduction(max: row_max) reduction(+: row_sum)
+    for (int x = x0; x < x1 - 1; x++)
+    {
+        const float v = std::min(std::max(ptr[x], 0.f), 1.f);
+        const float v_right = std::min(std::max(ptr[x + 1], 0.f), 1.f);
+        const float v_below = std::min(std::max(ptr_below[x], 0.f), 1.f);
+
+        row_min = std::min(row_min, v);
+        row_max = std::max(row_max, v);
+        row_sum += std::abs(v_right - v) + std::abs(v_below - v);
+    }
+
+    // the last column is its own right neighbour
+    {
+        const float v = std::min(std::max(ptr[x1 - 1], 0.f), 1.f);
+        const float v_below = std::min(std::max(ptr_below[x1 - 1], 0.f), 1.f);
+
+        row_min = std::min(row_min, v);
+        row_max = std::max(row_max, v);
+        row_sum += std::abs(v_below - v);
+    }
+
+    vmin = row_min;
+    vmax = row_max;
+    sum += row_sum;
+}
+
+// n samples of a tile row starting at x0 of a source row of w samples, edges replicated and values clamped like the preproc shaders
+static void preproc_row(const float* ptr, const int x0, const int n, const int w, float* out)
+{
+    const int left = std::clamp(-x0, 0, n);
+    const int right = std::clamp(w - x0, left, n);
+
+    const float v_left = std::min(std::max(ptr[0], 0.f), 1.f);
+    const float v_right = std::min(std::max(ptr[w - 1], 0.f), 1.f);
+
+    for (int x = 0; x < left; x++)
+        out[x] = v_left;
+
+    for (int x = left; x < right; x++)
+        out[x] = std::min(std::max(ptr[x0 + x], 0.f), 1.f);
+
+    for (int x = right; x < n; x++)
+        out[x] = v_right;
+}
+
+// out[x * step] = row[x], a row of the identity orientation written into another one
+static void scatter_row(const float* row, const int n, float* out, const ptrdiff_t step)
+{
+    if (step == 1)
+    {
+        std::memcpy(out, row, n * sizeof(float));
+        return;
+    }
+
+    for (int x = 0; x < n; x++)
+        out[x * step] = row[x];
+}
+
+// out[x] += ptr[x * step], a row of another orientation added onto the identity one
+static void accumulate_row(const float* ptr, const ptrdiff_t step, const int n, float* out)
+{
+    if (step == 1)
+    {
+        for (int x = 0; x < n; x++)
+            out[x] += ptr[x];
+        return;
+    }
+
+    if (step == -1)
+    {
+        for (int x = 0; x < n; x++)
+            out[x] += ptr[-x];
+        return;
+    }
+
+    for (int x = 0; x < n; x++)
+        out[x] += ptr[x * step];
+}
+
+// out[x] = out[x] * norm + add
+static void scale_row(float* out, const int n, const float norm, const float add)
+{
+    for (int x = 0; x < n; x++)
+        out[x] = out[x] * norm + add;
+}